@@ -0,0 +1,310 @@
+/* Microbenchmarks for the VMem allocator, run by `meson test --benchmark`.
+ * Every run replays the same pseudo-random sequence so that results can be compared between changes.
+ * An optional argument sets the number of operations of each benchmark (BENCH_OPS by default). */
+
+#define _POSIX_C_SOURCE 199309L /* clock_gettime() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vmem.h>
+
+#define BENCH_OPS 100000
+
+/* Population of the large-population benchmark, relative to the number of operations */
+#define BENCH_LARGE_FACTOR 10
+
+static size_t bench_ops = BENCH_OPS;
+static unsigned long bench_seed;
+
+static void **bench_ptrs;
+static size_t *bench_sizes;
+static unsigned long *bench_samples;
+
+static unsigned long bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+/* xorshift, so that the sequence doesn't depend on the C library */
+static unsigned long bench_rand(void)
+{
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+    return bench_seed;
+}
+
+/* Returns a random size of 1 to `max` quanta */
+static size_t bench_size(size_t quantum, size_t max)
+{
+    return (1 + bench_rand() % max) * quantum;
+}
+
+static void bench_shuffle(size_t n)
+{
+    size_t i, j, size;
+    void *ptr;
+
+    for (i = n - 1; i > 0; i--)
+    {
+        j = bench_rand() % (i + 1);
+
+        ptr = bench_ptrs[i];
+        bench_ptrs[i] = bench_ptrs[j];
+        bench_ptrs[j] = ptr;
+
+        size = bench_sizes[i];
+        bench_sizes[i] = bench_sizes[j];
+        bench_sizes[j] = size;
+    }
+}
+
+static void *bench_check(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        fprintf(stderr, "bench: allocation failed\n");
+        exit(1);
+    }
+
+    return ptr;
+}
+
+/* Boundary tags, hashtables and quantum caches used by the arenas */
+static size_t bench_metadata(Vmem *vmp, Vmem *source)
+{
+    VmemTagStat stat;
+    size_t bytes;
+
+    vmem_tag_stat(&stat);
+    bytes = stat.bytes + sizeof(*vmp) + vmp->hashsize * sizeof(*vmp->hashtable);
+
+    if (vmp->qcache_max != 0)
+        bytes += vmp->qcache_max / vmp->quantum * (sizeof(VmemQCache) + VMEM_NCPU * sizeof(VmemCpuCache));
+
+    if (source != NULL)
+        bytes += sizeof(*source) + source->hashsize * sizeof(*source->hashtable);
+
+    return bytes;
+}
+
+/* Not timed: makes sure that what's being measured didn't corrupt the arenas */
+static void bench_verify(Vmem *vmp, Vmem *source)
+{
+    if (vmem_verify(vmp) != 0 || (source != NULL && vmem_verify(source) != 0))
+        exit(1);
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Prints the throughput and the latency percentiles of the `n` operations timed in `bench_samples` */
+static void bench_report(const char *name, size_t n, unsigned long elapsed, size_t metadata)
+{
+    qsort(bench_samples, n, sizeof(*bench_samples), bench_cmp);
+
+    printf("%-28s %9lu %12.0f %7lu %7lu %7lu %7lu %9lu %10lu\n", name, (unsigned long)n,
+           elapsed ? n * 1e9 / elapsed : 0.0,
+           bench_samples[n / 2], bench_samples[n * 90 / 100], bench_samples[n * 99 / 100],
+           bench_samples[n * 999 / 1000], bench_samples[n - 1], (unsigned long)metadata);
+}
+
+/* Allocates `n` objects of random sizes, either with vmem_alloc() or with a constrained vmem_xalloc() */
+static void bench_alloc(const char *name, Vmem *vmp, Vmem *source, size_t n, size_t max, int vmflag, bool constrained)
+{
+    unsigned long start = bench_now(), t;
+    uintptr_t lo = (uintptr_t)vmp->base + vmp->size / 4, hi = (uintptr_t)vmp->base + vmp->size / 2;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        bench_sizes[i] = bench_size(vmp->quantum, max);
+        t = bench_now();
+
+        if (constrained)
+            bench_ptrs[i] = vmem_xalloc(vmp, bench_sizes[i], 0x100, vmp->quantum, 0x10000, (void *)lo, (void *)hi, vmflag);
+        else
+            bench_ptrs[i] = vmem_alloc(vmp, bench_sizes[i], vmflag);
+
+        bench_samples[i] = bench_now() - t;
+        bench_check(bench_ptrs[i]);
+    }
+
+    bench_report(name, n, bench_now() - start, bench_metadata(vmp, source));
+    bench_verify(vmp, source);
+}
+
+/* Frees the `n` objects in a random order */
+static void bench_free(const char *name, Vmem *vmp, Vmem *source, size_t n, bool constrained)
+{
+    unsigned long start, t;
+    size_t i, metadata = bench_metadata(vmp, source);
+
+    bench_shuffle(n);
+    start = bench_now();
+
+    for (i = 0; i < n; i++)
+    {
+        t = bench_now();
+
+        if (constrained)
+            vmem_xfree(vmp, bench_ptrs[i], bench_sizes[i]);
+        else
+            vmem_free(vmp, bench_ptrs[i], bench_sizes[i]);
+
+        bench_samples[i] = bench_now() - t;
+    }
+
+    bench_report(name, n, bench_now() - start, metadata);
+    bench_verify(vmp, source);
+}
+
+/* Replaces random objects of the `n` live ones by new ones, timing each free+alloc pair */
+static void bench_churn(const char *name, Vmem *vmp, size_t n, size_t max, int vmflag)
+{
+    unsigned long start = bench_now(), t;
+    size_t i, j;
+
+    for (i = 0; i < n; i++)
+    {
+        j = bench_rand() % n;
+        t = bench_now();
+
+        vmem_free(vmp, bench_ptrs[j], bench_sizes[j]);
+        bench_sizes[j] = bench_size(vmp->quantum, max);
+        bench_ptrs[j] = vmem_alloc(vmp, bench_sizes[j], vmflag);
+
+        bench_samples[i] = bench_now() - t;
+        bench_check(bench_ptrs[j]);
+    }
+
+    bench_report(name, n, bench_now() - start, bench_metadata(vmp, NULL));
+    bench_verify(vmp, NULL);
+}
+
+static void bench_policy(const char *name, int policy)
+{
+    static char label[64];
+    Vmem arena;
+
+    vmem_init(&arena, "bench", (void *)0x10000, 0x40000000, 0x10, NULL, NULL, NULL, 0, 0);
+
+    sprintf(label, "%s alloc", name);
+    bench_alloc(label, &arena, NULL, bench_ops, 64, policy | VM_NOSLEEP, false);
+    sprintf(label, "%s churn", name);
+    bench_churn(label, &arena, bench_ops, 64, policy | VM_NOSLEEP);
+    sprintf(label, "%s free", name);
+    bench_free(label, &arena, NULL, bench_ops, false);
+
+    vmem_destroy(&arena);
+}
+
+static void bench_qcache(void)
+{
+    Vmem arena;
+
+    vmem_init(&arena, "bench-qcache", (void *)0x10000, 0x40000000, 0x10, NULL, NULL, NULL, 0x10 * VMEM_QCACHES_N, 0);
+
+    bench_alloc("qcache alloc", &arena, NULL, bench_ops, VMEM_QCACHES_N, VM_INSTANTFIT | VM_NOSLEEP, false);
+    bench_churn("qcache churn", &arena, bench_ops, VMEM_QCACHES_N, VM_INSTANTFIT | VM_NOSLEEP);
+    bench_free("qcache free", &arena, NULL, bench_ops, false);
+
+    vmem_destroy(&arena);
+}
+
+static void bench_constrained(void)
+{
+    Vmem arena;
+
+    vmem_init(&arena, "bench-xalloc", (void *)0x10000, 0x40000000, 0x10, NULL, NULL, NULL, 0, 0);
+
+    bench_alloc("xalloc constrained alloc", &arena, NULL, bench_ops, 64, VM_INSTANTFIT | VM_NOSLEEP, true);
+    bench_free("xalloc constrained free", &arena, NULL, bench_ops, true);
+
+    vmem_destroy(&arena);
+}
+
+static void *bench_import(Vmem *vmp, size_t size, int vmflag)
+{
+    return vmem_alloc(vmp, size, vmflag);
+}
+
+static void bench_release(Vmem *vmp, void *addr, size_t size)
+{
+    vmem_free(vmp, addr, size);
+}
+
+static void bench_imported(void)
+{
+    Vmem source, arena;
+
+    vmem_init(&source, "bench-source", (void *)0x10000000, 0x40000000, 0x1000, NULL, NULL, NULL, 0, 0);
+    vmem_init(&arena, "bench-imported", NULL, 0, 0x10, bench_import, bench_release, &source, 0, 0);
+    vmem_set_import(&arena, 0x10000, 0x100000);
+
+    bench_alloc("imported alloc", &arena, &source, bench_ops, 64, VM_INSTANTFIT | VM_NOSLEEP, false);
+    bench_free("imported free", &arena, &source, bench_ops, false);
+
+    vmem_destroy(&arena);
+    vmem_destroy(&source);
+}
+
+static void bench_large(void)
+{
+    size_t n = bench_ops * BENCH_LARGE_FACTOR;
+    Vmem arena;
+
+    vmem_init(&arena, "bench-large", (void *)0x10000, 0x40000000, 0x10, NULL, NULL, NULL, 0, 0);
+
+    bench_alloc("large-population alloc", &arena, NULL, n, 4, VM_INSTANTFIT | VM_NOSLEEP, false);
+    bench_free("large-population free", &arena, NULL, n, false);
+
+    vmem_destroy(&arena);
+}
+
+int main(int argc, char **argv)
+{
+    size_t n;
+
+    if (argc > 1)
+        bench_ops = strtoul(argv[1], NULL, 0);
+
+    if (bench_ops == 0)
+        bench_ops = BENCH_OPS;
+
+    n = bench_ops * BENCH_LARGE_FACTOR;
+    bench_ptrs = malloc(n * sizeof(*bench_ptrs));
+    bench_sizes = malloc(n * sizeof(*bench_sizes));
+    bench_samples = malloc(n * sizeof(*bench_samples));
+
+    if (bench_ptrs == NULL || bench_sizes == NULL || bench_samples == NULL)
+        return 1;
+
+    bench_seed = 0x2545f4914f6cdd1dUL;
+    vmem_bootstrap();
+
+    printf("%-28s %9s %12s %7s %7s %7s %7s %9s %10s\n", "benchmark", "ops", "ops/s",
+           "p50 ns", "p90 ns", "p99 ns", "p999 ns", "max ns", "metadata");
+
+    bench_policy("instantfit", VM_INSTANTFIT);
+    bench_policy("bestfit", VM_BESTFIT);
+    bench_policy("nextfit", VM_NEXTFIT);
+    bench_qcache();
+    bench_constrained();
+    bench_imported();
+    bench_large();
+
+    free(bench_ptrs);
+    free(bench_sizes);
+    free(bench_samples);
+
+    return 0;
+}
@@ -0,0 +1,480 @@
+/* libFuzzer target for the VMem allocator, built by meson when the compiler supports -fsanitize=fuzzer.
+ * The input is decoded into an arena (quantum, quantum caches, initial span) and a sequence of vmem_add(),
+ * vmem_alloc()/vmem_xalloc() (with random constraints and policies), vmem_free()/vmem_xfree(), import and
+ * retention settings and reaps. An optional child arena imports its spans from the first one, like vmem_wired in test.c.
+ * Every operation is checked against a reference model, a map of the state of each quantum of the address space:
+ * allocations must be free and satisfy their constraints, failed allocations must really have had no room (when the
+ * arena has no quantum caches nor source to blur the picture), imports and releases must match the child's spans.
+ * vmem_verify() runs after every operation, and everything must be given back once the arenas are destroyed.
+ * Usage: vmem-fuzz [corpus directory], see the libFuzzer documentation for the options. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vmem.h>
+
+/* Size of the address space, in quanta */
+#define FUZZ_UNITS 1024
+
+/* Far from zero so that the constraints never wrap around */
+#define FUZZ_BASE ((uintptr_t)0x10000000)
+
+#define FUZZ_ADDR_MIN ((uintptr_t)0)
+#define FUZZ_ADDR_MAX (~(uintptr_t)0)
+
+/* State of a quantum in the model of an arena */
+#define FUZZ_MANAGED (1 << 0) /* In a span of the arena */
+#define FUZZ_SPAN (1 << 1)    /* First quantum of a span */
+#define FUZZ_ALLOC (1 << 2)   /* Allocated */
+
+#define FUZZ_CHECK(cond)                                                                  \
+    do                                                                                    \
+    {                                                                                     \
+        if (!(cond))                                                                      \
+        {                                                                                 \
+            fprintf(stderr, "%s:%d: vmem-fuzz: %s failed\n", __FILE__, __LINE__, #cond); \
+            abort();                                                                      \
+        }                                                                                 \
+    } while (0)
+
+enum
+{
+    FUZZ_OP_ADD,
+    FUZZ_OP_ALLOC,
+    FUZZ_OP_XALLOC,
+    FUZZ_OP_FREE,
+    FUZZ_OP_IMPORT,
+    FUZZ_OP_RETAIN,
+    FUZZ_OP_REAP,
+    FUZZ_OPS
+};
+
+typedef struct
+{
+    Vmem vmem;
+    unsigned char map[FUZZ_UNITS];
+    size_t in_use, total; /* Bytes allocated and managed according to the model */
+    bool exact;           /* No quantum caches nor source: a failed allocation means that nothing fits */
+} FuzzArena;
+
+typedef struct
+{
+    FuzzArena *arena;
+    uintptr_t addr;
+    size_t size;
+    bool constrained; /* Allocated with vmem_xalloc() */
+} FuzzObject;
+
+/* Constraints of an allocation, the defaults for vmem_alloc() */
+typedef struct
+{
+    size_t align, phase, nocross;
+    uintptr_t minaddr, maxaddr;
+} FuzzConstraints;
+
+static FuzzArena fuzz_parent, fuzz_child;
+static bool fuzz_has_child;
+static size_t fuzz_quantum;
+
+/* Every live object fills at least one quantum */
+static FuzzObject fuzz_live[FUZZ_UNITS];
+static size_t fuzz_nlive;
+
+static const uint8_t *fuzz_data;
+static size_t fuzz_len;
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/* The input is padded with zeros */
+static size_t fuzz_byte(void)
+{
+    if (fuzz_len == 0)
+        return 0;
+
+    fuzz_len--;
+    return *fuzz_data++;
+}
+
+static size_t fuzz_word(void)
+{
+    size_t lo = fuzz_byte();
+
+    return lo | (fuzz_byte() << 8);
+}
+
+static uintptr_t fuzz_addr(size_t unit)
+{
+    return FUZZ_BASE + unit * fuzz_quantum;
+}
+
+static size_t fuzz_unit(uintptr_t addr)
+{
+    return (addr - FUZZ_BASE) / fuzz_quantum;
+}
+
+/* Returns true if [addr, addr + size) is allocatable from `fa` with the constraints `c` according to the model */
+static bool fuzz_fits(FuzzArena *fa, uintptr_t addr, size_t size, const FuzzConstraints *c)
+{
+    size_t first, i;
+
+    if (addr < FUZZ_BASE || (addr - FUZZ_BASE) % fuzz_quantum != 0 || fuzz_unit(addr) + size / fuzz_quantum > FUZZ_UNITS)
+        return false;
+
+    if (addr < c->minaddr || addr + size > c->maxaddr || (addr - c->phase) % c->align != 0)
+        return false;
+
+    if (c->nocross != 0 && (addr ^ (addr + size - 1)) > c->nocross - 1)
+        return false;
+
+    /* Free quanta of a single span */
+    first = fuzz_unit(addr);
+
+    for (i = first; i < first + size / fuzz_quantum; i++)
+    {
+        if ((fa->map[i] & (FUZZ_MANAGED | FUZZ_ALLOC)) != FUZZ_MANAGED || (i != first && (fa->map[i] & FUZZ_SPAN)))
+            return false;
+    }
+
+    return true;
+}
+
+/* Returns true if the model has room for the allocation anywhere.
+ * Like in Bonwick's allocator, the nextfit rotor keeps the free segments around it apart until it moves on:
+ * an allocation can't straddle it. */
+static bool fuzz_room(FuzzArena *fa, size_t size, const FuzzConstraints *c)
+{
+    VmemSegment *prev = TAILQ_PREV(&fa->vmem.rotor, VmemSegQueue, segqueue), *next = TAILQ_NEXT(&fa->vmem.rotor, segqueue);
+    uintptr_t rotor = 0, addr;
+    size_t i;
+
+    if (prev != NULL && next != NULL && prev->type == SEGMENT_FREE && next->type == SEGMENT_FREE)
+        rotor = next->base;
+
+    for (i = 0; i + size / fuzz_quantum <= FUZZ_UNITS; i++)
+    {
+        addr = fuzz_addr(i);
+
+        if (fuzz_fits(fa, addr, size, c) && !(addr < rotor && addr + size > rotor))
+            return true;
+    }
+
+    return false;
+}
+
+static void fuzz_mark(FuzzArena *fa, uintptr_t addr, size_t size, bool alloc)
+{
+    size_t i;
+
+    for (i = fuzz_unit(addr); i < fuzz_unit(addr) + size / fuzz_quantum; i++)
+    {
+        FUZZ_CHECK(((fa->map[i] & FUZZ_ALLOC) != 0) != alloc);
+        fa->map[i] ^= FUZZ_ALLOC;
+    }
+
+    if (alloc)
+        fa->in_use += size;
+    else
+        fa->in_use -= size;
+}
+
+/* Checks an allocation against the model, and records it there */
+static void fuzz_allocated(FuzzArena *fa, void *ret, size_t size, const FuzzConstraints *c)
+{
+    if (ret == NULL)
+    {
+        FUZZ_CHECK(!fa->exact || !fuzz_room(fa, size, c));
+        return;
+    }
+
+    FUZZ_CHECK(fuzz_fits(fa, (uintptr_t)ret, size, c));
+    fuzz_mark(fa, (uintptr_t)ret, size, true);
+}
+
+static void fuzz_span(FuzzArena *fa, uintptr_t addr, size_t size, bool add)
+{
+    size_t first = fuzz_unit(addr), i;
+
+    for (i = first; i < first + size / fuzz_quantum; i++)
+        fa->map[i] = add ? FUZZ_MANAGED : 0;
+
+    if (add)
+    {
+        fa->map[first] |= FUZZ_SPAN;
+        fa->total += size;
+    }
+    else
+    {
+        fa->total -= size;
+    }
+}
+
+/* Imports of the child arena, from the parent */
+static void *fuzz_import(Vmem *vmp, size_t size, int vmflag)
+{
+    FuzzConstraints c = {0, 0, 0, FUZZ_ADDR_MIN, FUZZ_ADDR_MAX};
+    void *ret = vmem_alloc(vmp, size, vmflag);
+
+    c.align = fuzz_quantum;
+    fuzz_allocated(&fuzz_parent, ret, size, &c);
+
+    if (ret != NULL)
+        fuzz_span(&fuzz_child, (uintptr_t)ret, size, true);
+
+    return ret;
+}
+
+/* Only whole spans whose segments are all free can be given back */
+static void fuzz_release(Vmem *vmp, void *addr, size_t size)
+{
+    size_t first = fuzz_unit((uintptr_t)addr), end = first + size / fuzz_quantum, i;
+
+    FUZZ_CHECK(fuzz_child.map[first] & FUZZ_SPAN);
+    FUZZ_CHECK(end == FUZZ_UNITS || !(fuzz_child.map[end] & FUZZ_MANAGED) || (fuzz_child.map[end] & FUZZ_SPAN));
+
+    for (i = first; i < end; i++)
+        FUZZ_CHECK((fuzz_child.map[i] & (FUZZ_MANAGED | FUZZ_ALLOC)) == FUZZ_MANAGED);
+
+    fuzz_span(&fuzz_child, (uintptr_t)addr, size, false);
+    fuzz_mark(&fuzz_parent, (uintptr_t)addr, size, false);
+    vmem_free(vmp, addr, size);
+}
+
+/* Checks the arena against itself and the model */
+static void fuzz_verify(FuzzArena *fa)
+{
+    FUZZ_CHECK(vmem_verify(&fa->vmem) == 0);
+    FUZZ_CHECK(fa->vmem.stat.total == fa->total);
+
+    /* Quantum caches keep slabs allocated in the arena */
+    if (fa->vmem.qcache_max == 0)
+        FUZZ_CHECK(fa->vmem.stat.in_use == fa->in_use);
+    else
+        FUZZ_CHECK(fa->vmem.stat.in_use >= fa->in_use);
+}
+
+static FuzzArena *fuzz_arena(size_t b)
+{
+    return fuzz_has_child && (b & 1) ? &fuzz_child : &fuzz_parent;
+}
+
+static int fuzz_policy(size_t b)
+{
+    static const int policies[] = {VM_INSTANTFIT, VM_BESTFIT, VM_NEXTFIT, 0};
+
+    return policies[b & 3] | VM_NOSLEEP;
+}
+
+/* 1 to 32 quanta, times a power of two up to 128: the biggest sizes never fit */
+static size_t fuzz_size(void)
+{
+    size_t b = fuzz_byte();
+
+    return ((b & 31) + 1) << (b >> 5);
+}
+
+/* Adds random constraints to `c`, the defaults */
+static void fuzz_constraints(FuzzConstraints *c, size_t size)
+{
+    size_t b = fuzz_byte(), units, log;
+
+    if (b & 1)
+    {
+        c->align = fuzz_quantum << (fuzz_byte() % 8);
+        c->phase = fuzz_byte() % (c->align / fuzz_quantum) * fuzz_quantum;
+    }
+
+    /* A power of two that can hold the allocation */
+    if (b & 2)
+    {
+        for (units = size / fuzz_quantum, log = 0; ((size_t)1 << log) < units; log++)
+            ;
+
+        c->nocross = fuzz_quantum << (log + fuzz_byte() % 4);
+    }
+
+    if (b & 4)
+    {
+        c->minaddr = fuzz_addr(fuzz_word() % FUZZ_UNITS);
+        c->maxaddr = c->minaddr + (fuzz_word() % FUZZ_UNITS + 1) * fuzz_quantum;
+    }
+}
+
+static void fuzz_alloc(bool constrained)
+{
+    FuzzArena *fa = fuzz_arena(fuzz_byte());
+    int vmflag = fuzz_policy(fuzz_byte());
+    size_t size = fuzz_size() * fuzz_quantum;
+    FuzzObject *obj = &fuzz_live[fuzz_nlive];
+    FuzzConstraints c = {0, 0, 0, FUZZ_ADDR_MIN, FUZZ_ADDR_MAX};
+    void *ret;
+
+    c.align = fuzz_quantum;
+
+    if (constrained)
+    {
+        fuzz_constraints(&c, size);
+        ret = vmem_xalloc(&fa->vmem, size, c.align, c.phase, c.nocross, (void *)c.minaddr, (void *)c.maxaddr, vmflag);
+    }
+    else
+    {
+        ret = vmem_alloc(&fa->vmem, size, vmflag);
+    }
+
+    fuzz_allocated(fa, ret, size, &c);
+
+    if (ret == NULL)
+        return;
+
+    FUZZ_CHECK(fuzz_nlive < FUZZ_UNITS);
+    obj->arena = fa;
+    obj->addr = (uintptr_t)ret;
+    obj->size = size;
+    obj->constrained = constrained;
+    fuzz_nlive++;
+}
+
+static void fuzz_free(FuzzObject *obj)
+{
+    fuzz_mark(obj->arena, obj->addr, obj->size, false);
+
+    if (obj->constrained)
+        vmem_xfree(&obj->arena->vmem, (void *)obj->addr, obj->size);
+    else
+        vmem_free(&obj->arena->vmem, (void *)obj->addr, obj->size);
+
+    *obj = fuzz_live[--fuzz_nlive];
+}
+
+/* Adds a span, if it doesn't overlap the parent's */
+static void fuzz_add(void)
+{
+    size_t first = fuzz_word() % FUZZ_UNITS, units = fuzz_byte() % 64 + 1, i;
+
+    units = first + units > FUZZ_UNITS ? FUZZ_UNITS - first : units;
+
+    for (i = first; i < first + units; i++)
+    {
+        if (fuzz_parent.map[i] & FUZZ_MANAGED)
+            return;
+    }
+
+    FUZZ_CHECK(vmem_add(&fuzz_parent.vmem, (void *)fuzz_addr(first), units * fuzz_quantum, VM_NOSLEEP) != NULL);
+    fuzz_span(&fuzz_parent, fuzz_addr(first), units * fuzz_quantum, true);
+}
+
+static void fuzz_init(void)
+{
+    size_t b = fuzz_byte(), first, units, qcache_max;
+
+    memset(&fuzz_parent, 0, sizeof(fuzz_parent));
+    memset(&fuzz_child, 0, sizeof(fuzz_child));
+    fuzz_nlive = 0;
+
+    fuzz_quantum = (size_t)1 << ((b & 15) % 13);
+    fuzz_has_child = (b & 16) != 0;
+
+    /* The initial span, if any */
+    b = fuzz_byte();
+    first = fuzz_word() % FUZZ_UNITS;
+    units = b & 1 ? fuzz_word() % (FUZZ_UNITS - first) + 1 : 0;
+    qcache_max = ((b >> 1) & 31) * fuzz_quantum;
+
+    vmem_init(&fuzz_parent.vmem, "fuzz", units ? (void *)fuzz_addr(first) : NULL, units * fuzz_quantum, fuzz_quantum,
+              NULL, NULL, NULL, qcache_max, 0);
+    fuzz_parent.exact = fuzz_parent.vmem.qcache_max == 0;
+
+    if (units != 0)
+        fuzz_span(&fuzz_parent, fuzz_addr(first), units * fuzz_quantum, true);
+
+    if (fuzz_has_child)
+    {
+        vmem_init(&fuzz_child.vmem, "fuzz-child", NULL, 0, fuzz_quantum, fuzz_import, fuzz_release, &fuzz_parent.vmem,
+                  (b >> 6) * 4 * fuzz_quantum, 0);
+        fuzz_child.exact = false;
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static bool bootstrapped;
+    VmemTagStat before, after;
+    FuzzArena *fa;
+    size_t b;
+
+    if (!bootstrapped)
+    {
+        vmem_bootstrap();
+        bootstrapped = true;
+    }
+
+    vmem_tag_stat(&before);
+
+    fuzz_data = data;
+    fuzz_len = size;
+    fuzz_init();
+
+    while (fuzz_len > 0)
+    {
+        b = fuzz_byte();
+        fa = fuzz_arena(b >> 4);
+
+        switch (b % FUZZ_OPS)
+        {
+        case FUZZ_OP_ADD:
+            fuzz_add();
+            break;
+
+        case FUZZ_OP_ALLOC:
+            fuzz_alloc(false);
+            break;
+
+        case FUZZ_OP_XALLOC:
+            fuzz_alloc(true);
+            break;
+
+        case FUZZ_OP_FREE:
+            if (fuzz_nlive > 0)
+                fuzz_free(&fuzz_live[fuzz_word() % fuzz_nlive]);
+            break;
+
+        case FUZZ_OP_IMPORT:
+            b = fuzz_byte();
+            vmem_set_import(&fa->vmem, (b & 15) * fuzz_quantum, ((b & 15) * fuzz_quantum) << ((b >> 4) & 7));
+            break;
+
+        case FUZZ_OP_RETAIN:
+            b = fuzz_byte();
+            vmem_set_retain(&fa->vmem, b & 3, (b >> 2) * 4 * fuzz_quantum);
+            break;
+
+        case FUZZ_OP_REAP:
+            vmem_reap(&fa->vmem);
+            break;
+        }
+
+        fuzz_verify(&fuzz_parent);
+
+        if (fuzz_has_child)
+            fuzz_verify(&fuzz_child);
+    }
+
+    /* Everything must go back where it came from */
+    while (fuzz_nlive > 0)
+        fuzz_free(&fuzz_live[fuzz_nlive - 1]);
+
+    if (fuzz_has_child)
+    {
+        fuzz_verify(&fuzz_child);
+        vmem_destroy(&fuzz_child.vmem);
+        FUZZ_CHECK(fuzz_child.total == 0);
+    }
+
+    fuzz_verify(&fuzz_parent);
+    FUZZ_CHECK(fuzz_parent.in_use == 0);
+    vmem_destroy(&fuzz_parent.vmem);
+
+    vmem_tag_stat(&after);
+    FUZZ_CHECK(after.inuse == before.inuse);
+
+    return 0;
+}
@@ -0,0 +1,342 @@
+/* Replays a trace recorded with vmem_trace_start() against a fresh arena.
+ * Usage: vmem-replay <trace> [bestfit|instantfit|nextfit]
+ * The arena gets the quantum, quantum caches and spans of the traced one, and every allocation is redone
+ * (with the given policy instead of the traced one, if any). Addresses are mapped from the trace to the replay,
+ * frees of segments allocated before the trace started are skipped. Imports come from an unbounded source arena
+ * with the traced source's quantum.
+ * Throughput, fragmentation and boundary tag counts are printed every `events / REPLAY_REPORTS` events. */
+
+#define _POSIX_C_SOURCE 199309L /* clock_gettime() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vmem.h>
+
+#define REPLAY_REPORTS 10
+
+#define REPLAY_POLICY (VM_BESTFIT | VM_INSTANTFIT | VM_NEXTFIT)
+
+/* The source arena of replayed imports, far from the spans of any real trace */
+#define REPLAY_SOURCE_BASE ((uintptr_t)1 << (sizeof(void *) * 8 - 2))
+#define REPLAY_SOURCE_SIZE ((uintptr_t)1 << (sizeof(void *) * 8 - 3))
+
+/* Traced address -> replayed address, open addressing with linear probing. Key 0 is an empty slot. */
+typedef struct
+{
+    uintptr_t key;
+    void *addr;
+} ReplayMapping;
+
+static ReplayMapping *replay_map;
+static size_t replay_mapsize, replay_nmapped;
+
+static Vmem replay_arena, replay_source;
+static VmemTraceEvent *replay_events;
+static size_t replay_nevents;
+
+/* Totals printed at the end */
+static unsigned long replay_ops, replay_failed, replay_unexpected, replay_unmatched, replay_imports, replay_imported;
+
+static unsigned long replay_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+static size_t replay_slot(uintptr_t key)
+{
+    /* Fibonacci hashing, the low bits of addresses are mostly zeros */
+    return (size_t)((key * 0x9e3779b97f4a7c15UL) >> 17) & (replay_mapsize - 1);
+}
+
+static void replay_map_put(uintptr_t key, void *addr)
+{
+    ReplayMapping *old = replay_map;
+    size_t oldsize = replay_mapsize, i;
+
+    /* Keep the map at most half full */
+    if ((replay_nmapped + 1) * 2 > replay_mapsize)
+    {
+        replay_mapsize = replay_mapsize ? replay_mapsize * 2 : 1024;
+        replay_map = calloc(replay_mapsize, sizeof(*replay_map));
+
+        if (replay_map == NULL)
+        {
+            fprintf(stderr, "replay: out of memory\n");
+            exit(1);
+        }
+
+        replay_nmapped = 0;
+
+        for (i = 0; i < oldsize; i++)
+        {
+            if (old[i].key != 0)
+                replay_map_put(old[i].key, old[i].addr);
+        }
+
+        free(old);
+    }
+
+    for (i = replay_slot(key); replay_map[i].key != 0; i = (i + 1) & (replay_mapsize - 1))
+        ;
+
+    replay_map[i].key = key;
+    replay_map[i].addr = addr;
+    replay_nmapped++;
+}
+
+/* Removes the mapping of `key` and returns its replayed address, NULL if there's none */
+static void *replay_map_take(uintptr_t key)
+{
+    size_t i, j, k;
+    void *addr;
+
+    if (replay_mapsize == 0)
+        return NULL;
+
+    for (i = replay_slot(key); replay_map[i].key != key; i = (i + 1) & (replay_mapsize - 1))
+    {
+        if (replay_map[i].key == 0)
+            return NULL;
+    }
+
+    addr = replay_map[i].addr;
+    replay_nmapped--;
+
+    /* Shift the following entries back so that no probe sequence is broken */
+    for (j = (i + 1) & (replay_mapsize - 1); replay_map[j].key != 0; j = (j + 1) & (replay_mapsize - 1))
+    {
+        k = replay_slot(replay_map[j].key);
+
+        if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j))
+        {
+            replay_map[i] = replay_map[j];
+            i = j;
+        }
+    }
+
+    replay_map[i].key = 0;
+
+    return addr;
+}
+
+static void *replay_import(Vmem *vmp, size_t size, int vmflag)
+{
+    replay_imported++;
+    return vmem_alloc(vmp, size, vmflag);
+}
+
+static void replay_release(Vmem *vmp, void *addr, size_t size)
+{
+    vmem_free(vmp, addr, size);
+}
+
+static int replay_read(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    long len;
+
+    if (f == NULL || fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0)
+        return -1;
+
+    replay_nevents = (size_t)len / sizeof(*replay_events);
+    replay_events = malloc(replay_nevents * sizeof(*replay_events) + 1);
+
+    if (replay_events == NULL || fread(replay_events, sizeof(*replay_events), replay_nevents, f) != replay_nevents)
+        return -1;
+
+    fclose(f);
+
+    return replay_nevents > 0 && replay_events[0].type == VMEM_TRACE_ARENA ? 0 : -1;
+}
+
+/* Initializes the replay arena like the traced one */
+static void replay_init(void)
+{
+    VmemTraceEvent *arena = &replay_events[0], *source = &replay_events[1];
+
+    if (replay_nevents < 2 || source->type != VMEM_TRACE_SOURCE)
+    {
+        vmem_init(&replay_arena, "replay", NULL, 0, arena->addr, NULL, NULL, NULL, arena->size, arena->vmflag);
+        return;
+    }
+
+    vmem_init(&replay_source, "replay-source", (void *)REPLAY_SOURCE_BASE, REPLAY_SOURCE_SIZE, (size_t)1 << source->vmflag,
+              NULL, NULL, NULL, 0, 0);
+    vmem_init(&replay_arena, "replay", NULL, 0, arena->addr, replay_import, replay_release, &replay_source, arena->size, arena->vmflag);
+    vmem_set_import(&replay_arena, source->addr, source->size);
+}
+
+static void replay_report(size_t event, unsigned long ops, unsigned long elapsed)
+{
+    VmemTagStat tags;
+    VmemStat stat;
+
+    vmem_stat(&replay_arena, &stat);
+    vmem_tag_stat(&tags);
+
+    printf("%10lu %12.0f %8lu %12lu %12lu %6.2f %12lu %8lu %8lu\n", (unsigned long)event,
+           elapsed ? ops * 1e9 / elapsed : 0.0, (unsigned long)replay_nmapped,
+           (unsigned long)stat.in_use, (unsigned long)stat.free, stat.extfrag / 100.0, (unsigned long)stat.largest,
+           (unsigned long)tags.inuse, (unsigned long)tags.peak);
+}
+
+/* Takes note of the result of a replayed allocation */
+static void replay_allocated(const VmemTraceEvent *ev, void *addr)
+{
+    if (addr == NULL)
+    {
+        replay_failed += ev->addr != 0;
+        return;
+    }
+
+    /* The traced allocation failed: don't keep what it couldn't have used */
+    if (ev->addr == 0)
+    {
+        replay_unexpected++;
+
+        if (ev->type == VMEM_TRACE_XALLOC)
+            vmem_xfree(&replay_arena, addr, ev->size);
+        else
+            vmem_free(&replay_arena, addr, ev->size);
+
+        return;
+    }
+
+    replay_map_put(ev->addr, addr);
+}
+
+int main(int argc, char **argv)
+{
+    size_t align = 0, phase = 0, nocross = 0, i, step;
+    uintptr_t minaddr = 0, maxaddr = ~(uintptr_t)0;
+    unsigned long start, ops;
+    int policy = 0, vmflag;
+    VmemTraceEvent *ev;
+    void *addr;
+
+    if (argc > 2)
+    {
+        if (strcmp(argv[2], "bestfit") == 0)
+            policy = VM_BESTFIT;
+        else if (strcmp(argv[2], "instantfit") == 0)
+            policy = VM_INSTANTFIT;
+        else if (strcmp(argv[2], "nextfit") == 0)
+            policy = VM_NEXTFIT;
+    }
+
+    if (argc < 2 || (argc > 2 && policy == 0))
+    {
+        fprintf(stderr, "usage: %s <trace> [bestfit|instantfit|nextfit]\n", argv[0]);
+        return 1;
+    }
+
+    if (replay_read(argv[1]) != 0)
+    {
+        fprintf(stderr, "replay: %s isn't a vmem trace\n", argv[1]);
+        return 1;
+    }
+
+    vmem_bootstrap();
+    replay_init();
+
+    printf("trace: %s, %lu events, quantum %#lx\n", argv[1], (unsigned long)replay_nevents,
+           (unsigned long)replay_events[0].addr);
+    printf("%10s %12s %8s %12s %12s %6s %12s %8s %8s\n", "event", "ops/s", "live", "in use", "free", "frag%",
+           "largest free", "tags", "peak");
+
+    step = replay_nevents / REPLAY_REPORTS ? replay_nevents / REPLAY_REPORTS : 1;
+    start = replay_now();
+    ops = 0;
+
+    for (i = 1; i < replay_nevents; i++)
+    {
+        ev = &replay_events[i];
+        vmflag = policy ? (ev->vmflag & ~REPLAY_POLICY) | policy : ev->vmflag;
+
+        /* Another policy may fail where the traced one didn't: count the failure instead of asserting */
+        vmflag |= VM_NOSLEEP;
+
+        switch (ev->type)
+        {
+        case VMEM_TRACE_ADD:
+            vmem_add(&replay_arena, (void *)ev->addr, ev->size, VM_NOSLEEP);
+            break;
+
+        case VMEM_TRACE_IMPORT:
+            replay_imports++;
+            break;
+
+        case VMEM_TRACE_ALIGN:
+            align = ev->addr;
+            phase = ev->size;
+            break;
+
+        case VMEM_TRACE_NOCROSS:
+            nocross = ev->size;
+            break;
+
+        case VMEM_TRACE_RANGE:
+            minaddr = ev->addr;
+            maxaddr = ev->size;
+            break;
+
+        case VMEM_TRACE_ALLOC:
+            replay_allocated(ev, vmem_alloc(&replay_arena, ev->size, vmflag));
+            ops++;
+            break;
+
+        case VMEM_TRACE_XALLOC:
+            addr = vmem_xalloc(&replay_arena, ev->size, align, phase, nocross, (void *)minaddr, (void *)maxaddr, vmflag);
+            replay_allocated(ev, addr);
+            ops++;
+
+            align = phase = nocross = 0;
+            minaddr = 0;
+            maxaddr = ~(uintptr_t)0;
+            break;
+
+        case VMEM_TRACE_FREE:
+        case VMEM_TRACE_XFREE:
+            addr = replay_map_take(ev->addr);
+
+            if (addr == NULL)
+                replay_unmatched++;
+            else if (ev->type == VMEM_TRACE_XFREE)
+                vmem_xfree(&replay_arena, addr, ev->size);
+            else
+                vmem_free(&replay_arena, addr, ev->size);
+
+            ops++;
+            break;
+
+        default:
+            break;
+        }
+
+        if (i % step == 0)
+        {
+            replay_report(i, ops, replay_now() - start);
+            replay_ops += ops;
+
+            if (vmem_verify(&replay_arena) != 0)
+                return 1;
+
+            start = replay_now();
+            ops = 0;
+        }
+    }
+
+    replay_report(replay_nevents, ops, replay_now() - start);
+    replay_ops += ops;
+
+    printf("%lu operations, %lu failed allocations, %lu allocations that failed in the trace, "
+           "%lu frees of unknown segments, %lu imports traced, %lu replayed\n",
+           replay_ops, replay_failed, replay_unexpected, replay_unmatched, replay_imports, replay_imported);
+
+    return 0;
+}
@@ -5,16 +5,21 @@
 #include <stdarg.h>
 #include <setjmp.h>
 #include <cmocka.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
 #include <vmem.h>
 /* clang-format on */
 
 #define VMEM_ADDR_MIN (void *)0
 #define VMEM_ADDR_MAX (void *)(~(uintptr_t)0)
+#define ARR_SIZE(x) (sizeof(x) / sizeof(*x))
 
 /* We cannot use cmocka's state since it requires C99 */
 static Vmem vmem_va;
 static Vmem vmem_wired;
+static Vmem vmem_cached;
+static Vmem vmem_boot;
 
 static void *internal_allocwired(Vmem *vmem, size_t size, int vmflag)
 {
@@ -87,9 +92,1050 @@ static void test_vmem_imported(void **state)
 
     assert_ptr_equal(ret, (void *)0x1000);
     assert_ptr_equal(ret2, (void *)0x2000);
+    assert_int_equal(vmem_wired.stat.import, 0x2000);
 
     vmem_free(&vmem_wired, ret, 0x1000);
     vmem_free(&vmem_wired, ret2, 0x1000);
+
+    /* Both spans are given back to the source */
+    assert_int_equal(vmem_wired.stat.import, 0);
+}
+
+static void test_vmem_import_policy(void **state)
+{
+    void *ptrs[5];
+    size_t i;
+
+    (void)state;
+
+    vmem_set_import(&vmem_wired, 0x4000, 0x10000);
+
+    /* The first import is big enough for the next allocations */
+    for (i = 0; i < 4; i++)
+        ptrs[i] = vmem_alloc(&vmem_wired, 0x1000, VM_INSTANTFIT);
+
+    assert_int_equal(vmem_wired.stat.import, 0x4000);
+
+    /* The next one is twice as big */
+    ptrs[4] = vmem_alloc(&vmem_wired, 0x1000, VM_INSTANTFIT);
+    assert_int_equal(vmem_wired.stat.import, 0x4000 + 0x8000);
+
+    for (i = 0; i < ARR_SIZE(ptrs); i++)
+        vmem_free(&vmem_wired, ptrs[i], 0x1000);
+
+    assert_int_equal(vmem_wired.stat.import, 0);
+
+    vmem_set_import(&vmem_wired, 0, 0);
+}
+
+static void test_vmem_import_constrained(void **state)
+{
+    VmemCounters before, after;
+    size_t used = vmem_va.stat.in_use;
+    void *ret;
+
+    (void)state;
+
+    /* An aligned allocation imports a single span, with room for the alignment wherever it starts */
+    vmem_counters(&vmem_wired, &before);
+    ret = vmem_xalloc(&vmem_wired, 0x1000, 0x10000, 0, 0, VMEM_ADDR_MIN, VMEM_ADDR_MAX, VM_INSTANTFIT);
+    vmem_counters(&vmem_wired, &after);
+
+    assert_int_equal((uintptr_t)ret % 0x10000, 0);
+    assert_int_equal(after.imports - before.imports, 1);
+    assert_int_equal(vmem_wired.stat.import, 0x10000);
+
+    vmem_xfree(&vmem_wired, ret, 0x1000);
+    assert_int_equal(vmem_wired.stat.import, 0);
+
+    /* The source can't give out addresses in this range: one import is tried, and given back */
+    vmem_counters(&vmem_wired, &before);
+    assert_null(vmem_xalloc(&vmem_wired, 0x1000, 0, 0, 0, (void *)0x200000, (void *)0x201000, VM_INSTANTFIT | VM_NOSLEEP));
+    vmem_counters(&vmem_wired, &after);
+
+    assert_int_equal(after.imports - before.imports, 1);
+    assert_int_equal(vmem_wired.stat.import, 0);
+    assert_int_equal(vmem_va.stat.in_use, used);
+    assert_int_equal(vmem_verify(&vmem_wired), 0);
+}
+
+static Vmem vmem_unlocked;
+static int unlocked_calls, unlocked_held;
+
+/* Counts the locks of `vmem_unlocked` that are held: its own, and those of the CPU slots of its first quantum cache */
+static int unlocked_locks(void)
+{
+    int i, n = vmem_unlocked.lock != 0;
+
+    for (i = 0; vmem_unlocked.qcache != NULL && i < VMEM_NCPU; i++)
+        n += vmem_unlocked.qcache[0].cpu[i].lock != 0;
+
+    return n;
+}
+
+static void *internal_alloc_unlocked(Vmem *vmem, size_t size, int vmflag)
+{
+    unlocked_calls++;
+    unlocked_held += unlocked_locks();
+    return vmem_alloc(vmem, size, vmflag);
+}
+
+static void internal_free_unlocked(Vmem *vmem, void *ptr, size_t size)
+{
+    unlocked_calls++;
+    unlocked_held += unlocked_locks();
+    vmem_free(vmem, ptr, size);
+}
+
+static void test_vmem_import_unlocked(void **state)
+{
+    void *ret;
+
+    (void)state;
+
+    vmem_init(&vmem_unlocked, "tests-unlocked", 0, 0, 0x1000, internal_alloc_unlocked, internal_free_unlocked, &vmem_va, 0, 0);
+
+    /* The import and the release run without the child's lock */
+    ret = vmem_alloc(&vmem_unlocked, 0x1000, VM_INSTANTFIT);
+    assert_ptr_not_equal(ret, NULL);
+    vmem_free(&vmem_unlocked, ret, 0x1000);
+
+    assert_int_equal(unlocked_calls, 2);
+    assert_int_equal(unlocked_held, 0);
+    assert_int_equal(vmem_verify(&vmem_unlocked), 0);
+
+    vmem_destroy(&vmem_unlocked);
+
+    /* Neither do the magazine refills of the quantum caches, nor the flushes when the arena is destroyed */
+    vmem_init(&vmem_unlocked, "tests-unlocked", 0, 0, 0x1000, internal_alloc_unlocked, internal_free_unlocked, &vmem_va, 0x1000, 0);
+
+    ret = vmem_alloc(&vmem_unlocked, 0x1000, VM_INSTANTFIT);
+    assert_ptr_not_equal(ret, NULL);
+    vmem_free(&vmem_unlocked, ret, 0x1000);
+    vmem_destroy(&vmem_unlocked);
+
+    assert_true(unlocked_calls > 2);
+    assert_int_equal(unlocked_held, 0);
+    assert_int_equal(vmem_unlocked.stat.import, 0);
+}
+
+static void test_vmem_retain(void **state)
+{
+    void *ret;
+
+    (void)state;
+
+    vmem_set_retain(&vmem_wired, 1, 0x1000);
+
+    /* The span is kept once free, and reused by the next allocation */
+    ret = vmem_alloc(&vmem_wired, 0x1000, VM_INSTANTFIT);
+    vmem_free(&vmem_wired, ret, 0x1000);
+    assert_int_equal(vmem_wired.stat.import, 0x1000);
+
+    ret = vmem_alloc(&vmem_wired, 0x1000, VM_INSTANTFIT);
+    assert_int_equal(vmem_wired.stat.import, 0x1000);
+    vmem_free(&vmem_wired, ret, 0x1000);
+
+    /* It survives the first reap, but not a whole interval without being used */
+    vmem_reap(&vmem_wired);
+    assert_int_equal(vmem_wired.stat.import, 0x1000);
+
+    vmem_reap(&vmem_wired);
+    assert_int_equal(vmem_wired.stat.import, 0);
+
+    vmem_set_retain(&vmem_wired, 0, 0);
+}
+
+static void test_vmem_trace(void **state)
+{
+    VmemTraceEvent trace[5];
+    void *ret, *ret2;
+
+    (void)state;
+
+    /* The arena description alone (the arena and its span) needs two events */
+    assert_int_equal(vmem_trace_start(&vmem_va, trace, 2), -VMEM_ERR_NO_MEM);
+    assert_int_equal(vmem_trace_start(&vmem_va, trace, 5), 0);
+
+    ret = vmem_alloc(&vmem_va, 0x1000, VM_INSTANTFIT);
+    ret2 = vmem_xalloc(&vmem_va, 0x1000, 0x4000, 0, 0, VMEM_ADDR_MIN, VMEM_ADDR_MAX, VM_INSTANTFIT);
+    vmem_free(&vmem_va, ret, 0x1000);
+    vmem_xfree(&vmem_va, ret2, 0x1000);
+
+    /* The ring only kept the three most recent events, the alignment of the vmem_xalloc() was overwritten */
+    assert_int_equal(vmem_trace_stop(&vmem_va), 5);
+
+    assert_int_equal(trace[0].type, VMEM_TRACE_ARENA);
+    assert_int_equal(trace[0].addr, 0x1000);
+    assert_int_equal(trace[1].type, VMEM_TRACE_ADD);
+    assert_int_equal(trace[1].addr, 0x1000);
+    assert_int_equal(trace[2].type, VMEM_TRACE_XALLOC);
+    assert_int_equal(trace[2].addr, (uintptr_t)ret2);
+    assert_int_equal(trace[3].type, VMEM_TRACE_FREE);
+    assert_int_equal(trace[3].addr, (uintptr_t)ret);
+    assert_int_equal(trace[4].type, VMEM_TRACE_XFREE);
+    assert_int_equal(trace[4].size, 0x1000);
+}
+
+static void test_vmem_stat(void **state)
+{
+    VmemStat stat;
+    Vmem arena;
+    void *a, *b, *c;
+
+    (void)state;
+
+    vmem_init(&arena, "tests-stat", (void *)0x1000, 0x10000, 0x1000, NULL, NULL, NULL, 0, 0);
+
+    a = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+    b = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+    c = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+    vmem_free(&arena, b, 0x1000);
+
+    /* A one page hole, and the 13 pages after `c` */
+    vmem_stat(&arena, &stat);
+    assert_int_equal(stat.alloc, 3);
+    assert_int_equal(stat.frees, 1);
+    assert_int_equal(stat.free, 0xe000);
+    assert_int_equal(stat.freesegs, 2);
+    assert_int_equal(stat.largest, 0xd000);
+    assert_int_equal(stat.extfrag, 0x1000 * 10000 / 0xe000);
+    assert_int_equal(stat.freelist_segs[12], 1);
+    assert_int_equal(stat.freelist_bytes[15], 0xd000);
+
+    /* Everything coalesces back into the initial span */
+    vmem_free(&arena, a, 0x1000);
+    vmem_free(&arena, c, 0x1000);
+    vmem_stat(&arena, &stat);
+    assert_int_equal(stat.freesegs, 1);
+    assert_int_equal(stat.extfrag, 0);
+
+    vmem_destroy(&arena);
+}
+
+/* Each freemap bit must be set exactly when its freelist has segments */
+static int freemap_matches(Vmem *vmp)
+{
+    VmemStat stat;
+    size_t i;
+
+    vmem_stat(vmp, &stat);
+
+    for (i = 0; i < FREELISTS_N; i++)
+    {
+        if (!(vmp->freemap & ((uintptr_t)1 << i)) != !stat.freelist_segs[i])
+            return 0;
+    }
+
+    return 1;
+}
+
+static void test_vmem_freemap(void **state)
+{
+    Vmem arena;
+    void *a, *b, *c, *d;
+
+    (void)state;
+
+    vmem_init(&arena, "tests-freemap", (void *)0x1000, 0x10000, 0x1000, NULL, NULL, NULL, 0, 0);
+    assert_int_equal(arena.freemap, (uintptr_t)1 << 16);
+
+    a = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+    assert_int_equal(arena.freemap, (uintptr_t)1 << 15);
+
+    /* A two page hole before `c`, and the 12 pages after it */
+    b = vmem_alloc(&arena, 0x2000, VM_INSTANTFIT);
+    c = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+    vmem_free(&arena, b, 0x2000);
+    assert_int_equal(arena.freemap, ((uintptr_t)1 << 13) | ((uintptr_t)1 << 15));
+    assert_true(freemap_matches(&arena));
+
+    /* Emptying a freelist clears its bit */
+    assert_ptr_equal(vmem_alloc(&arena, 0x2000, VM_INSTANTFIT), b);
+    assert_int_equal(arena.freemap, (uintptr_t)1 << 15);
+
+    d = vmem_alloc(&arena, 0xc000, VM_INSTANTFIT);
+    assert_int_equal(arena.freemap, 0);
+    assert_ptr_equal(vmem_alloc(&arena, 0x1000, VM_INSTANTFIT | VM_NOSLEEP), NULL);
+
+    vmem_free(&arena, b, 0x2000);
+    vmem_free(&arena, d, 0xc000);
+    assert_true(freemap_matches(&arena));
+    vmem_free(&arena, a, 0x1000);
+    vmem_free(&arena, c, 0x1000);
+    assert_int_equal(arena.freemap, (uintptr_t)1 << 16);
+    assert_int_equal(vmem_verify(&arena), 0);
+
+    vmem_destroy(&arena);
+}
+
+static void test_vmem_counters(void **state)
+{
+    VmemCounters counters;
+    Vmem arena;
+    void *a, *b, *c, *d;
+
+    (void)state;
+
+    vmem_init(&arena, "tests-counters", (void *)0x1000, 0x10000, 0x1000, NULL, NULL, NULL, 0, 0);
+
+    a = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+    b = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+    c = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+
+    /* Nothing is big enough, and there's no source to import from */
+    assert_null(vmem_alloc(&arena, 0x20000, VM_INSTANTFIT | VM_NOSLEEP));
+
+    vmem_free(&arena, b, 0x1000); /* Between two allocated segments */
+    vmem_free(&arena, a, 0x1000); /* `b` is on its right */
+    vmem_free(&arena, c, 0x1000); /* Free segments on both sides */
+
+    vmem_counters(&arena, &counters);
+    assert_int_equal(counters.misses, 1);
+    assert_int_equal(counters.instant_slow, 1);
+    assert_int_equal(counters.coalesce_left, 1);
+    assert_int_equal(counters.coalesce_right, 2);
+    assert_true(counters.hash_walked >= 3);
+    assert_true(counters.buckets >= 3);
+    assert_true(counters.populates > 0);
+
+    /* The only hole that fits is in the freelist instant fit skips, behind a smaller one.
+     * It's searched once importing fails, without building the trees. */
+    a = vmem_alloc(&arena, 0x3000, VM_INSTANTFIT);
+    b = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+    c = vmem_alloc(&arena, 0x2000, VM_INSTANTFIT);
+    d = vmem_alloc(&arena, 0xa000, VM_INSTANTFIT);
+    vmem_free(&arena, a, 0x3000);
+    vmem_free(&arena, c, 0x2000);
+    assert_ptr_equal(vmem_alloc(&arena, 0x3000, VM_INSTANTFIT), a);
+    assert_true(!arena.trees);
+
+    vmem_free(&arena, a, 0x3000);
+    vmem_free(&arena, b, 0x1000);
+    vmem_free(&arena, d, 0xa000);
+    vmem_destroy(&arena);
+}
+
+static void test_vmem_exact_fit(void **state)
+{
+    VmemCounters before, after;
+    VmemTagStat tags_before, tags;
+    Vmem arena;
+    void *a, *b, *c, *ret;
+    size_t i;
+
+    (void)state;
+
+    vmem_init(&arena, "tests-exact", (void *)0x1000, 0x10000, 0x1000, NULL, NULL, NULL, 0, 0);
+
+    /* A one page hole between two allocated segments */
+    a = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+    b = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+    c = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+    vmem_free(&arena, b, 0x1000);
+
+    /* The first exact fit swaps the free tag for an allocated one, which may top up the reserve of that class */
+    ret = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+    vmem_free(&arena, ret, 0x1000);
+
+    /* Exact fits don't split, so once the arena's reserves are warm they never take tags from the global pool */
+    vmem_counters(&arena, &before);
+    vmem_tag_stat(&tags_before);
+
+    for (i = 0; i < 100; i++)
+    {
+        ret = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+        assert_ptr_equal(ret, b);
+        vmem_free(&arena, ret, 0x1000);
+    }
+
+    vmem_counters(&arena, &after);
+    vmem_tag_stat(&tags);
+    assert_int_equal(after.populates, before.populates);
+    assert_int_equal(tags.inuse, tags_before.inuse);
+    assert_int_equal(vmem_verify(&arena), 0);
+
+    vmem_free(&arena, a, 0x1000);
+    vmem_free(&arena, c, 0x1000);
+    vmem_destroy(&arena);
+}
+
+static void test_vmem_timing(void **state)
+{
+    VmemHistogram alloc, frees;
+    size_t i, n = 0;
+    void *ret;
+
+    (void)state;
+
+    vmem_set_timing(&vmem_va, true);
+    ret = vmem_alloc(&vmem_va, 0x1000, VM_INSTANTFIT);
+    vmem_free(&vmem_va, ret, 0x1000);
+
+    /* Not recorded anymore */
+    vmem_set_timing(&vmem_va, false);
+    ret = vmem_alloc(&vmem_va, 0x1000, VM_INSTANTFIT);
+    vmem_free(&vmem_va, ret, 0x1000);
+
+    vmem_histograms(&vmem_va, &alloc, &frees);
+    assert_int_equal(alloc.count, 1);
+    assert_int_equal(frees.count, 1);
+
+    for (i = 0; i < VMEM_HIST_BUCKETS; i++)
+    {
+        n += alloc.buckets[i];
+
+        /* The latency falls in the only bucket counted */
+        if (alloc.buckets[i] != 0)
+            assert_true(vmem_hist_min(i) <= alloc.max && (i + 1 == VMEM_HIST_BUCKETS || alloc.max < vmem_hist_min(i + 1)));
+
+        if (i > 0)
+            assert_true(vmem_hist_min(i) > vmem_hist_min(i - 1));
+    }
+
+    assert_int_equal(n, 1);
+}
+
+static void test_vmem_qcache(void **state)
+{
+    void *ret = vmem_alloc(&vmem_cached, 0x1000, VM_INSTANTFIT);
+    void *ret2;
+    int prev_in_use = vmem_cached.stat.in_use;
+
+    (void)state;
+
+    /* Freed objects stay allocated in the arena, and are handed out again by the cache */
+    vmem_free(&vmem_cached, ret, 0x1000);
+    assert_int_equal(vmem_cached.stat.in_use, prev_in_use);
+
+    ret2 = vmem_alloc(&vmem_cached, 0x1000, VM_INSTANTFIT);
+    assert_ptr_equal(ret, ret2);
+
+    /* vmem_xalloc() bypasses the quantum caches */
+    ret = vmem_xalloc(&vmem_cached, 0x1000, 0, 0, 0, VMEM_ADDR_MIN, VMEM_ADDR_MAX, VM_INSTANTFIT);
+    assert_ptr_not_equal(ret, ret2);
+
+    vmem_xfree(&vmem_cached, ret, 0x1000);
+    vmem_free(&vmem_cached, ret2, 0x1000);
+}
+
+static void test_vmem_magazines(void **state)
+{
+    void *ptrs[21];
+    Vmem arena;
+    size_t i;
+
+    (void)state;
+
+    /* Only arenas with quantum caches get a CPU layer, and every CPU slot has its own cache lines */
+    assert_null(vmem_va.qcache);
+    assert_int_equal(vmem_init(&arena, "tests-magazines", (void *)0x1000, 0x100000, 0x1000, NULL, NULL, NULL, 0x1000, 0), 0);
+    assert_int_equal((uintptr_t)&arena.qcache[0].cpu[1] % VMEM_CACHE_LINE, 0);
+
+    /* The arena is only asked for objects by half magazines */
+    ptrs[0] = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+    assert_int_equal(arena.stat.in_use, VMEM_MAGAZINE_ROUNDS / 2 * 0x1000);
+
+    for (i = 1; i < ARR_SIZE(ptrs); i++)
+        ptrs[i] = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+
+    assert_int_equal(arena.stat.in_use, ARR_SIZE(ptrs) * 0x1000);
+
+    /* The loaded magazine fills up and is swapped with the previous one, nothing goes back to the arena */
+    for (i = ARR_SIZE(ptrs); i > 0; i--)
+        vmem_free(&arena, ptrs[i - 1], 0x1000);
+
+    assert_int_equal(arena.stat.in_use, ARR_SIZE(ptrs) * 0x1000);
+
+    /* The last objects freed come back first, then the full previous magazine is swapped in */
+    for (i = 0; i <= VMEM_MAGAZINE_ROUNDS / 2; i++)
+        assert_ptr_equal(vmem_alloc(&arena, 0x1000, VM_INSTANTFIT), ptrs[i]);
+
+    assert_int_equal(arena.stat.in_use, ARR_SIZE(ptrs) * 0x1000);
+
+    for (i = 0; i <= VMEM_MAGAZINE_ROUNDS / 2; i++)
+        vmem_free(&arena, ptrs[i], 0x1000);
+
+    /* Destroying the arena gives the cached objects back */
+    vmem_destroy(&arena);
+    assert_int_equal(arena.stat.in_use, 0);
+}
+
+static void test_vmem_qcache_short(void **state)
+{
+    void *ptrs[4];
+    Vmem arena;
+    size_t i;
+
+    (void)state;
+
+    /* A magazine refill wants more objects than the arena has, it settles for what's there */
+    vmem_init(&arena, "tests-qcache-short", (void *)0x1000, 0x4000, 0x1000, NULL, NULL, NULL, 0x1000, 0);
+
+    for (i = 0; i < ARR_SIZE(ptrs); i++)
+    {
+        ptrs[i] = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+        assert_ptr_not_equal(ptrs[i], NULL);
+    }
+
+    assert_null(vmem_alloc(&arena, 0x1000, VM_INSTANTFIT | VM_NOSLEEP));
+
+    for (i = 0; i < ARR_SIZE(ptrs); i++)
+        vmem_free(&arena, ptrs[i], 0x1000);
+
+    vmem_destroy(&arena);
+}
+
+static void test_vmem_reap(void **state)
+{
+    void *ptrs[64];
+    size_t i, prev_in_use = vmem_cached.stat.in_use;
+
+    (void)state;
+
+    for (i = 0; i < 64; i++)
+        ptrs[i] = vmem_alloc(&vmem_cached, 0x2000, VM_INSTANTFIT);
+
+    for (i = 0; i < 64; i++)
+        vmem_free(&vmem_cached, ptrs[i], 0x2000);
+
+    /* The depot's full magazines aren't used during the next interval, they are given back to the arena */
+    vmem_reap(&vmem_cached);
+    vmem_reap(&vmem_cached);
+
+    /* Only the CPU layer (two magazines) remains cached */
+    assert_true(vmem_cached.stat.in_use <= prev_in_use + 2 * VMEM_MAGAZINE_ROUNDS * 0x2000);
+}
+
+static void test_vmem_hashtable(void **state)
+{
+    static Vmem vmem_hash;
+    static void *ptrs[4096];
+    size_t i;
+
+    (void)state;
+
+    vmem_init(&vmem_hash, "tests-hash", (void *)0x1000, 0x100000, 0x10, NULL, NULL, NULL, 0, 0);
+
+    for (i = 0; i < ARR_SIZE(ptrs); i++)
+        ptrs[i] = vmem_alloc(&vmem_hash, 0x10, VM_INSTANTFIT);
+
+    /* The hashtable grew with the number of allocated segments */
+    assert_true(vmem_hash.hashsize >= ARR_SIZE(ptrs) / 2);
+
+    for (i = 0; i < ARR_SIZE(ptrs); i++)
+        vmem_free(&vmem_hash, ptrs[i], 0x10);
+
+    /* Frees never resize it, the allocations that follow shrink it */
+    assert_true(vmem_hash.hashsize >= ARR_SIZE(ptrs) / 2);
+
+    for (i = 0; i < ARR_SIZE(ptrs); i++)
+        vmem_free(&vmem_hash, vmem_alloc(&vmem_hash, 0x10, VM_INSTANTFIT), 0x10);
+
+    assert_true(vmem_hash.hashsize < ARR_SIZE(ptrs) / 2);
+    assert_int_equal(vmem_hash.stat.in_use, 0);
+
+    vmem_destroy(&vmem_hash);
+}
+
+static void test_vmem_tags(void **state)
+{
+    static void *pages[1024];
+    VmemTagStat before, stat;
+    Vmem arena;
+    size_t i;
+
+    (void)state;
+
+    /* The tags of the arena created with VM_BOOTSTRAP came from the static reserve, and stay there */
+    vmem_tag_stat(&before);
+    assert_true(before.reserve < 128);
+
+    /* A peak of allocated tags takes slab pages... */
+    vmem_init(&arena, "tests-tags", (void *)0x100000, 0x400000, 0x1000, NULL, NULL, NULL, 0, 0);
+
+    for (i = 0; i < ARR_SIZE(pages); i++)
+        pages[i] = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+
+    vmem_tag_stat(&stat);
+    assert_true(stat.inuse >= before.inuse + ARR_SIZE(pages));
+    assert_true(stat.peak >= stat.inuse);
+    assert_true(stat.bytes >= before.bytes + 8 * 4096);
+
+    /* ...that go back to the page allocator afterwards, except for one empty slab per tag class */
+    for (i = 0; i < ARR_SIZE(pages); i++)
+        vmem_free(&arena, pages[i], 0x1000);
+
+    vmem_destroy(&arena);
+    vmem_tag_stat(&stat);
+    assert_int_equal(stat.inuse, before.inuse);
+    assert_true(stat.bytes <= before.bytes + VMEM_TAG_CLASSES * 4096);
+
+    /* VM_BOOTSTRAP allocations never allocate slab pages, they use the static reserve once the slabs are full.
+     * The boot arena is big enough to need more tags than the slabs have left. */
+    vmem_tag_stat(&before);
+
+    for (i = 0; i < 256; i++)
+    {
+        pages[i] = vmem_alloc(&vmem_boot, 0x1000, VM_INSTANTFIT | VM_BOOTSTRAP | VM_NOSLEEP);
+        assert_ptr_not_equal(pages[i], NULL);
+    }
+
+    vmem_tag_stat(&stat);
+    assert_true(stat.bytes <= before.bytes);
+    assert_true(stat.reserve < before.reserve);
+    assert_int_equal(vmem_verify(&vmem_boot), 0);
+
+    for (i = 0; i < 256; i++)
+        vmem_free(&vmem_boot, pages[i], 0x1000);
+
+    assert_int_equal(vmem_verify(&vmem_boot), 0);
+}
+
+static void test_vmem_free_pending(void **state)
+{
+    static void *pages[64];
+    VmemCounters before, after;
+    Vmem arena;
+    size_t i;
+
+    (void)state;
+
+    vmem_init(&arena, "tests-free-pending", (void *)0x100000, ARR_SIZE(pages) * 0x1000, 0x1000, NULL, NULL, NULL, 0, 0);
+
+    for (i = 0; i < ARR_SIZE(pages); i++)
+        pages[i] = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+
+    /* Every other segment has no free neighbor and needs a full-size tag, more than the reserve holds.
+     * The frees never allocate tags: the segments the reserve can't cover wait in the pending list */
+    vmem_counters(&arena, &before);
+
+    for (i = 0; i < ARR_SIZE(pages); i += 2)
+        vmem_free(&arena, pages[i], 0x1000);
+
+    vmem_counters(&arena, &after);
+    assert_int_equal(after.populates, before.populates);
+    assert_true(!STAILQ_EMPTY(&arena.pending));
+    assert_int_equal(arena.stat.in_use, ARR_SIZE(pages) / 2 * 0x1000);
+    assert_int_equal(vmem_verify(&arena), 0);
+
+    /* The next allocation puts them in the freelists */
+    pages[0] = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+    assert_true(STAILQ_EMPTY(&arena.pending));
+    assert_int_equal(arena.stat.freesegs, ARR_SIZE(pages) / 2 - 1);
+    assert_int_equal(vmem_verify(&arena), 0);
+
+    vmem_free(&arena, pages[0], 0x1000);
+
+    for (i = 1; i < ARR_SIZE(pages); i += 2)
+        vmem_free(&arena, pages[i], 0x1000);
+
+    vmem_free(&arena, vmem_alloc(&arena, 0x1000, VM_INSTANTFIT), 0x1000);
+    assert_int_equal(vmem_verify(&arena), 0);
+    assert_int_equal(arena.stat.in_use, 0);
+    vmem_destroy(&arena);
+}
+
+/* Before tag classes, every tag took 56 bytes on 64 bit hosts: an enum, a bool, the base and size, a TAILQ and a LIST entry */
+#define BASELINE_TAG_SIZE (7 * sizeof(void *))
+
+static void test_vmem_tag_size(void **state)
+{
+    static void *pages[2048];
+    VmemTagStat before, stat;
+    Vmem arena;
+    size_t i;
+
+    (void)state;
+
+    assert_true(offsetof(VmemSegment, f) < BASELINE_TAG_SIZE);
+
+    /* Allocated segments take less tag memory than before, slab headers included */
+    vmem_tag_stat(&before);
+    vmem_init(&arena, "tests-tag-size", (void *)0x100000, ARR_SIZE(pages) * 0x1000, 0x1000, NULL, NULL, NULL, 0, 0);
+
+    for (i = 0; i < ARR_SIZE(pages); i++)
+        pages[i] = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+
+    vmem_tag_stat(&stat);
+    assert_true(stat.bytes - before.bytes < ARR_SIZE(pages) * BASELINE_TAG_SIZE);
+
+    for (i = 0; i < ARR_SIZE(pages); i++)
+        vmem_free(&arena, pages[i], 0x1000);
+
+    vmem_destroy(&arena);
+}
+
+static void test_vmem_nextfit(void **state)
+{
+    static Vmem vmem_pid;
+    size_t i;
+    void *pid;
+
+    (void)state;
+
+    vmem_init(&vmem_pid, "tests-pid", (void *)1, 100, 1, NULL, NULL, NULL, 0, 0);
+
+    /* Every PID is used once before any of them is reused */
+    for (i = 1; i <= 100; i++)
+    {
+        pid = vmem_alloc(&vmem_pid, 1, VM_NEXTFIT);
+        assert_ptr_equal(pid, (void *)i);
+        vmem_free(&vmem_pid, pid, 1);
+    }
+
+    pid = vmem_alloc(&vmem_pid, 1, VM_NEXTFIT);
+    assert_ptr_equal(pid, (void *)1);
+    vmem_free(&vmem_pid, pid, 1);
+
+    assert_int_equal(vmem_pid.stat.in_use, 0);
+
+    vmem_destroy(&vmem_pid);
+}
+
+static void test_vmem_bestfit(void **state)
+{
+    void *ptr1, *ptr2, *ptr3, *ptr4, *ret;
+
+    (void)state;
+
+    ptr1 = vmem_alloc(&vmem_va, 0x3000, VM_INSTANTFIT);
+    ptr2 = vmem_alloc(&vmem_va, 0x1000, VM_INSTANTFIT);
+    ptr3 = vmem_alloc(&vmem_va, 0x2000, VM_INSTANTFIT);
+    ptr4 = vmem_alloc(&vmem_va, 0x1000, VM_INSTANTFIT);
+
+    /* Leave a 0x2000 hole and a 0x3000 hole, the latter being at the head of its freelist */
+    vmem_free(&vmem_va, ptr3, 0x2000);
+    vmem_free(&vmem_va, ptr1, 0x3000);
+
+    /* Instant fit takes the head of the first list that's big enough, best fit takes the smallest hole */
+    ret = vmem_alloc(&vmem_va, 0x2000, VM_INSTANTFIT);
+    assert_ptr_equal(ret, ptr1);
+    vmem_free(&vmem_va, ret, 0x2000);
+
+    /* The trees are only built by the first request that needs them */
+    assert_true(!vmem_va.trees);
+    ret = vmem_alloc(&vmem_va, 0x2000, VM_BESTFIT);
+    assert_ptr_equal(ret, ptr3);
+    assert_true(vmem_va.trees);
+    assert_int_equal(vmem_verify(&vmem_va), 0);
+    vmem_free(&vmem_va, ret, 0x2000);
+
+    vmem_free(&vmem_va, ptr2, 0x1000);
+    vmem_free(&vmem_va, ptr4, 0x1000);
+}
+
+static void test_vmem_aligned_search(void **state)
+{
+    static void *pages[608];
+    VmemCounters before, after;
+    Vmem arena;
+    size_t i;
+    void *ret;
+
+    (void)state;
+
+    vmem_init(&arena, "tests-aligned", (void *)0x100000, 0x260000, 0x1000, NULL, NULL, NULL, 0, 0);
+
+    for (i = 0; i < ARR_SIZE(pages); i++)
+        pages[i] = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+
+    /* 32 unaligned two page holes, then two 32 page segments: one at 0x300000 and one past `maxaddr`, at the head of their freelist */
+    for (i = 0; i < 512; i += 16)
+    {
+        vmem_free(&arena, pages[i + 1], 0x1000);
+        vmem_free(&arena, pages[i + 2], 0x1000);
+        pages[i + 1] = pages[i + 2] = NULL;
+    }
+
+    for (i = 512; i < 592; i++)
+    {
+        if (i == 544)
+            i = 560;
+
+        vmem_free(&arena, pages[i], 0x1000);
+        pages[i] = NULL;
+    }
+
+    /* The list heads don't fit, and the address tree search skips the small holes instead of rejecting each of them */
+    vmem_counters(&arena, &before);
+    ret = vmem_xalloc(&arena, 0x2000, 0x10000, 0, 0, (void *)0x100000, (void *)0x320000, VM_INSTANTFIT);
+    vmem_counters(&arena, &after);
+
+    assert_ptr_equal(ret, (void *)0x300000);
+    assert_int_equal(after.instant_slow - before.instant_slow, 1);
+    assert_true(after.fit_rejects - before.fit_rejects <= 2);
+    vmem_xfree(&arena, ret, 0x2000);
+
+    /* Without a big enough segment, a small hole that happens to be aligned is still found */
+    ret = vmem_xalloc(&arena, 0x2000, 0x10000, 0x1000, 0, (void *)0x100000, (void *)0x120000, VM_INSTANTFIT);
+    assert_ptr_equal(ret, (void *)0x101000);
+    vmem_xfree(&arena, ret, 0x2000);
+
+    for (i = 0; i < ARR_SIZE(pages); i++)
+    {
+        if (pages[i] != NULL)
+            vmem_free(&arena, pages[i], 0x1000);
+    }
+
+    assert_int_equal(vmem_verify(&arena), 0);
+    vmem_destroy(&arena);
+}
+
+static void test_vmem_constrained(void **state)
+{
+    static Vmem vmem_small;
+    void *ret;
+
+    (void)state;
+
+    /* Constrained to a range */
+    ret = vmem_xalloc(&vmem_va, 0x1000, 0, 0, 0, (void *)0x80000, (void *)0x90000, VM_INSTANTFIT);
+    assert_true((uintptr_t)ret >= 0x80000 && (uintptr_t)ret + 0x1000 <= 0x90000);
+    vmem_xfree(&vmem_va, ret, 0x1000);
+
+    /* Aligned with a phase */
+    ret = vmem_xalloc(&vmem_va, 0x1000, 0x10000, 0x2000, 0, VMEM_ADDR_MIN, VMEM_ADDR_MAX, VM_INSTANTFIT);
+    assert_int_equal((uintptr_t)ret % 0x10000, 0x2000);
+    vmem_xfree(&vmem_va, ret, 0x1000);
+
+    /* [0x3800, 0x4800) would cross a 0x4000 boundary */
+    ret = vmem_xalloc(&vmem_va, 0x1000, 0x1000, 0x800, 0x4000, (void *)0x3800, VMEM_ADDR_MAX, VM_INSTANTFIT);
+    assert_ptr_equal(ret, (void *)0x4800);
+    vmem_xfree(&vmem_va, ret, 0x1000);
+
+    ret = vmem_xalloc(&vmem_va, 0x3000, 0, 0, 0x4000, (void *)0x2000, VMEM_ADDR_MAX, VM_BESTFIT);
+    assert_ptr_equal(ret, (void *)0x4000);
+    vmem_xfree(&vmem_va, ret, 0x3000);
+
+    /* Every address aligned on 0x10000 with a phase of 0x3800 crosses a 0x4000 boundary */
+    ret = vmem_xalloc(&vmem_va, 0x1000, 0x10000, 0x3800, 0x4000, VMEM_ADDR_MIN, VMEM_ADDR_MAX, VM_INSTANTFIT | VM_NOSLEEP);
+    assert_null(ret);
+
+    /* The range doesn't fit in the arena */
+    ret = vmem_xalloc(&vmem_va, 0x1000, 0, 0, 0, (void *)0x200000, (void *)0x300000, VM_INSTANTFIT | VM_NOSLEEP);
+    assert_null(ret);
+
+    /* The only free segment (0x5000 bytes) is in the freelist that instant fit skips for a 0x5000 bytes allocation */
+    vmem_init(&vmem_small, "tests-small", (void *)0x1000, 0x5000, 0x1000, NULL, NULL, NULL, 0, 0);
+
+    ret = vmem_alloc(&vmem_small, 0x5000, VM_INSTANTFIT | VM_NOSLEEP);
+    assert_ptr_equal(ret, (void *)0x1000);
+    vmem_free(&vmem_small, ret, 0x5000);
+
+    vmem_destroy(&vmem_small);
+}
+
+#define STRESS_THREADS 4
+#define STRESS_OPS 20000
+#define STRESS_LIVE 64
+
+typedef struct
+{
+    Vmem *arena;
+    void *addr;
+    size_t size;
+    bool constrained;
+} StressObject;
+
+static Vmem stress_arena, stress_child;
+static int stress_failures;
+
+static void *stress_thread(void *arg)
+{
+    StressObject live[STRESS_LIVE], *obj;
+    unsigned long seed = 0x2545f4914f6cdd1dUL * ((uintptr_t)arg + 1);
+    size_t i;
+
+    memset(live, 0, sizeof(live));
+
+    for (i = 0; i < STRESS_OPS; i++)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        obj = &live[seed % STRESS_LIVE];
+
+        if (obj->addr != NULL)
+        {
+            if (obj->constrained)
+                vmem_xfree(obj->arena, obj->addr, obj->size);
+            else
+                vmem_free(obj->arena, obj->addr, obj->size);
+
+            obj->addr = NULL;
+        }
+        else
+        {
+            /* Cached and uncached sizes, from the arena and from its importing child */
+            obj->arena = (seed >> 8) % 2 ? &stress_arena : &stress_child;
+            obj->size = ((seed >> 9) % 8 + 1) * 0x1000;
+            obj->constrained = (seed >> 12) % 8 == 0;
+
+            if (obj->constrained)
+                obj->addr = vmem_xalloc(obj->arena, obj->size, 0x4000, 0, 0, VMEM_ADDR_MIN, VMEM_ADDR_MAX, VM_INSTANTFIT | VM_NOSLEEP);
+            else
+                obj->addr = vmem_alloc(obj->arena, obj->size, VM_INSTANTFIT | VM_NOSLEEP);
+
+            if (obj->addr == NULL)
+                __sync_fetch_and_add(&stress_failures, 1);
+        }
+
+        /* While the other threads keep going */
+        if (i % 1000 == 0 && (vmem_verify(&stress_arena) != 0 || vmem_verify(&stress_child) != 0))
+            __sync_fetch_and_add(&stress_failures, 1);
+    }
+
+    for (obj = live; obj < &live[STRESS_LIVE]; obj++)
+    {
+        if (obj->addr != NULL && obj->constrained)
+            vmem_xfree(obj->arena, obj->addr, obj->size);
+        else if (obj->addr != NULL)
+            vmem_free(obj->arena, obj->addr, obj->size);
+    }
+
+    return NULL;
+}
+
+static void test_vmem_threads(void **state)
+{
+    pthread_t threads[STRESS_THREADS];
+    uintptr_t i;
+
+    (void)state;
+
+    vmem_init(&stress_arena, "tests-stress", (void *)0x10000000, 0x10000000, 0x1000, NULL, NULL, NULL, 0x4000, 0);
+    vmem_init(&stress_child, "tests-stress-child", 0, 0, 0x1000, internal_allocwired, internal_freewired, &stress_arena, 0, 0);
+    vmem_set_import(&stress_child, 0x10000, 0x100000);
+
+    for (i = 0; i < STRESS_THREADS; i++)
+        assert_int_equal(pthread_create(&threads[i], NULL, stress_thread, (void *)i), 0);
+
+    for (i = 0; i < STRESS_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    assert_int_equal(stress_failures, 0);
+    assert_int_equal(vmem_verify(&stress_arena), 0);
+    assert_int_equal(vmem_verify(&stress_child), 0);
+    assert_int_equal(stress_child.stat.in_use, 0);
+
+    vmem_destroy(&stress_child);
+    vmem_destroy(&stress_arena);
+    assert_int_equal(stress_arena.stat.in_use, 0);
+}
+
+static Vmem trace_arena;
+static volatile int trace_done;
+static volatile size_t trace_ops;
+
+static void *trace_thread(void *arg)
+{
+    void *ret;
+
+    (void)arg;
+
+    while (!__atomic_load_n(&trace_done, __ATOMIC_RELAXED))
+    {
+        ret = vmem_alloc(&trace_arena, 0x1000, VM_INSTANTFIT);
+        vmem_free(&trace_arena, ret, 0x1000);
+        __sync_fetch_and_add(&trace_ops, 1);
+    }
+
+    return NULL;
+}
+
+static void wait_trace_ops(size_t n)
+{
+    size_t start = __atomic_load_n(&trace_ops, __ATOMIC_RELAXED);
+
+    while (__atomic_load_n(&trace_ops, __ATOMIC_RELAXED) - start < n)
+        ;
+}
+
+static void test_vmem_trace_threads(void **state)
+{
+    static VmemTraceEvent trace[16384], copy[16384];
+    pthread_t threads[STRESS_THREADS];
+    size_t i, n;
+
+    (void)state;
+
+    vmem_init(&trace_arena, "tests-trace-threads", (void *)0x1000, 0x100000, 0x1000, NULL, NULL, NULL, 0x4000, 0);
+
+    for (i = 0; i < STRESS_THREADS; i++)
+        assert_int_equal(pthread_create(&threads[i], NULL, trace_thread, NULL), 0);
+
+    /* The quantum caches record their events without the arena lock, none may land once the trace is stopped.
+     * The ring is much bigger than what's recorded, so that no writer can fall a whole ring behind another. */
+    for (i = 0; i < 20; i++)
+    {
+        assert_int_equal(vmem_trace_start(&trace_arena, trace, ARR_SIZE(trace)), 0);
+        wait_trace_ops(512);
+        n = vmem_trace_stop(&trace_arena);
+        assert_true(n > 1 && n <= ARR_SIZE(trace));
+
+        memcpy(copy, trace, sizeof(trace));
+        wait_trace_ops(512);
+        assert_int_equal(memcmp(copy, trace, sizeof(trace)), 0);
+    }
+
+    __atomic_store_n(&trace_done, 1, __ATOMIC_RELAXED);
+
+    for (i = 0; i < STRESS_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    assert_int_equal(vmem_verify(&trace_arena), 0);
+    vmem_destroy(&trace_arena);
+}
+
+static void test_vmem_verify(void **state)
+{
+    VmemSegment *seg;
+    Vmem arena;
+    void *ret;
+
+    (void)state;
+
+    /* Whatever the previous tests did, the arenas are still consistent */
+    assert_int_equal(vmem_verify(&vmem_va), 0);
+    assert_int_equal(vmem_verify(&vmem_wired), 0);
+    assert_int_equal(vmem_verify(&vmem_cached), 0);
+
+    /* The bootstrap arena got its tags from the static reserve, whatever their class */
+    assert_int_equal(vmem_verify(&vmem_boot), 0);
+    ret = vmem_alloc(&vmem_boot, 0x1000, VM_INSTANTFIT | VM_BOOTSTRAP);
+    assert_int_equal(vmem_verify(&vmem_boot), 0);
+    vmem_free(&vmem_boot, ret, 0x1000);
+    assert_int_equal(vmem_verify(&vmem_boot), 0);
+
+    vmem_init(&arena, "tests-verify", (void *)0x1000, 0x10000, 0x1000, NULL, NULL, NULL, 0, 0);
+    ret = vmem_alloc(&arena, 0x1000, VM_INSTANTFIT);
+    assert_int_equal(vmem_verify(&arena), 0);
+
+    /* Statistics that don't match the segments */
+    arena.stat.in_use++;
+    assert_int_equal(vmem_verify(&arena), -VMEM_ERR_CORRUPT);
+    arena.stat.in_use--;
+
+    /* The remaining 15 pages, moved to the freelist of single pages */
+    seg = LIST_FIRST(&arena.freelist[15]);
+    LIST_REMOVE(seg, f.seglist);
+    LIST_INSERT_HEAD(&arena.freelist[12], seg, f.seglist);
+    assert_int_equal(vmem_verify(&arena), -VMEM_ERR_CORRUPT);
+    LIST_REMOVE(seg, f.seglist);
+    LIST_INSERT_HEAD(&arena.freelist[15], seg, f.seglist);
+    assert_int_equal(vmem_verify(&arena), 0);
+
+    /* A span moved over the last page of the first one, with its free segment */
+    vmem_add(&arena, (void *)0x20000, 0x1000, 0);
+    seg = TAILQ_LAST(&arena.segqueue, VmemSegQueue);
+    seg->base = TAILQ_PREV(seg, VmemSegQueue, segqueue)->base = 0x10000;
+    assert_int_equal(vmem_verify(&arena), -VMEM_ERR_CORRUPT);
+    seg->base = TAILQ_PREV(seg, VmemSegQueue, segqueue)->base = 0x20000;
+    assert_int_equal(vmem_verify(&arena), 0);
+
+    vmem_free(&arena, ret, 0x1000);
+    vmem_destroy(&arena);
 }
 
 int vmem_run_tests(void)
@@ -100,15 +1146,45 @@ int vmem_run_tests(void)
         cmocka_unit_test(test_vmem_free),
         cmocka_unit_test(test_vmem_free_coalesce),
         cmocka_unit_test(test_vmem_imported),
+        cmocka_unit_test(test_vmem_import_policy),
+        cmocka_unit_test(test_vmem_import_constrained),
+        cmocka_unit_test(test_vmem_import_unlocked),
+        cmocka_unit_test(test_vmem_retain),
+        cmocka_unit_test(test_vmem_bestfit),
+        cmocka_unit_test(test_vmem_constrained),
+        cmocka_unit_test(test_vmem_aligned_search),
+        cmocka_unit_test(test_vmem_trace),
+        cmocka_unit_test(test_vmem_stat),
+        cmocka_unit_test(test_vmem_freemap),
+        cmocka_unit_test(test_vmem_counters),
+        cmocka_unit_test(test_vmem_exact_fit),
+        cmocka_unit_test(test_vmem_timing),
+        cmocka_unit_test(test_vmem_qcache),
+        cmocka_unit_test(test_vmem_magazines),
+        cmocka_unit_test(test_vmem_qcache_short),
+        cmocka_unit_test(test_vmem_reap),
+        cmocka_unit_test(test_vmem_hashtable),
+        cmocka_unit_test(test_vmem_tags),
+        cmocka_unit_test(test_vmem_free_pending),
+        cmocka_unit_test(test_vmem_tag_size),
+        cmocka_unit_test(test_vmem_nextfit),
+        cmocka_unit_test(test_vmem_threads),
+        cmocka_unit_test(test_vmem_trace_threads),
+        cmocka_unit_test(test_vmem_verify),
     };
 
+    /* Created first, when there are no tag slabs yet, like the arena a kernel bootstraps with */
+    vmem_init(&vmem_boot, "tests-boot", (void *)0x1000, 0x100000, 0x1000, NULL, NULL, NULL, 0, VM_BOOTSTRAP);
     vmem_init(&vmem_va, "tests-va", (void *)0x1000, 0x100000, 0x1000, NULL, NULL, NULL, 0, 0);
     vmem_init(&vmem_wired, "tests-wired", 0, 0, 0x1000, internal_allocwired, internal_freewired, &vmem_va, 0, 0);
+    vmem_init(&vmem_cached, "tests-cached", (void *)0x1000, 0x100000, 0x1000, NULL, NULL, NULL, 0x4000, 0);
 
     r = cmocka_run_group_tests(tests, NULL, NULL);
 
     vmem_destroy(&vmem_va);
     vmem_destroy(&vmem_wired);
+    vmem_destroy(&vmem_cached);
+    vmem_destroy(&vmem_boot);
 
     return r;
 }
@@ -6,6 +6,10 @@
  * More implementation details are available in "vmem.h"
  */
 
+#ifndef __KERNEL__
+#    define _POSIX_C_SOURCE 200112L /* posix_memalign() */
+#endif
+
 #include <string.h>
 #include <sys/queue.h>
 #include <vmem.h>
@@ -16,9 +20,22 @@
 #    include <stdlib.h>
 #    define vmem_printf printf
 #    define ASSERT assert
-#    define vmem_alloc_pages(x) malloc(x * 4096)
+#    define vmem_free_pages(x, n) free(x)
+#endif
+
+#ifndef VMEM_PAGE_SIZE
+#    define VMEM_PAGE_SIZE 4096
 #endif
 
+/* Boundary tags kept in each arena's reserve: enough for an import (span + free segment) followed by a split on both sides */
+#define VMEM_SEGS_MIN 4
+
+/* Above this, tags freed by an arena go back to the global pool */
+#define VMEM_SEGS_MAX 16
+
+/* Number of old hashtable buckets migrated by each hashtable operation while resizing */
+#define VMEM_REHASH_STEP 4
+
 #define ARR_SIZE(x) (sizeof(x) / sizeof(*x))
 #define VMEM_ADDR_MIN 0
 #define VMEM_ADDR_MAX (~(uintptr_t)0)
@@ -33,73 +50,340 @@
 #define VMEM_ALIGNUP(addr, align) \
     (((addr) + (align)-1) & ~((align)-1))
 
+/* Returns true if [addr, addr + size) straddles a `boundary`-aligned address */
+#define VMEM_CROSSES(addr, size, boundary) \
+    (((addr) ^ ((addr) + (size)-1)) > ((boundary)-1))
+
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
-/* We need to keep a global freelist of segments because allocating virtual memory (e.g allocating a segment) requires segments to describe it. (kernel only)
- In non-kernel code, this is handled by the host `malloc` and `free` standard library functions */
+/* Boundary tags are carved out of page-sized slabs, each slab starts with this header.
+ * Slabs must be page aligned so that a tag can find its slab by masking its address. */
+typedef struct vmem_seg_slab
+{
+    LIST_ENTRY(vmem_seg_slab) link; /* In VmemSegPool::partial while the slab has free tags */
+    VmemSegSList freesegs;          /* Free tags of this slab */
+    size_t nfree;                   /* Number of tags in `freesegs` */
+    struct vmem_seg_pool *pool;     /* Pool this slab belongs to */
+} VmemSegSlab;
+
+LIST_HEAD(VmemSlabList, vmem_seg_slab);
+
+/* There is one pool of slabs for each tag size */
+typedef struct vmem_seg_pool
+{
+    struct VmemSlabList partial; /* Slabs that have free tags */
+    size_t nempty;               /* Number of completely free slabs in `partial`, only one is kept around */
+    size_t tagsize;              /* Size of the tags of this pool */
+} VmemSegPool;
+
+#define SLAB_NSEGS(pool) ((VMEM_PAGE_SIZE - sizeof(VmemSegSlab)) / (pool)->tagsize)
+#define SLAB_SEG(slab, i) ((VmemSegment *)((char *)((slab) + 1) + (i) * (slab)->pool->tagsize))
+#define SLAB_OF(seg) ((VmemSegSlab *)((uintptr_t)(seg) & ~(uintptr_t)(VMEM_PAGE_SIZE - 1)))
+
+static VmemSegPool seg_pools[VMEM_TAG_CLASSES] = {
+    {LIST_HEAD_INITIALIZER(partial), 0, sizeof(VmemSegment)},
+    {LIST_HEAD_INITIALIZER(partial), 0, offsetof(VmemSegment, f)}};
+
+/* Allocating virtual memory (e.g allocating a slab) may itself require boundary tags to describe it.
+ * These statically allocated tags are handed out while bootstrapping (VM_BOOTSTRAP) or when no page can be allocated. */
 static VmemSegment static_segs[128];
-static VmemSegList free_segs = LIST_HEAD_INITIALIZER(free_segs);
-static int nfreesegs = 0;
+static VmemSegSList reserve_segs = SLIST_HEAD_INITIALIZER(reserve_segs);
+
+/* The boundary tag pool is shared between every arena, its lock is only held for a few list operations */
+static VmemLock seg_lock = 0;
+static VmemTagStat seg_stat;
+
+/* Magazines are carved out of page-sized slabs too, each slab starts with this header */
+typedef struct vmem_mag_slab
+{
+    LIST_ENTRY(vmem_mag_slab) link; /* In `mag_partial` while the slab has free magazines */
+    VmemMagList freemags;           /* Free magazines of this slab */
+    size_t nfree;                   /* Number of magazines in `freemags` */
+} VmemMagSlab;
+
+LIST_HEAD(VmemMagSlabList, vmem_mag_slab);
+
+#define MAG_SLAB_NMAGS ((VMEM_PAGE_SIZE - sizeof(VmemMagSlab)) / sizeof(VmemMagazine))
+#define MAG_SLAB_OF(mag) ((VmemMagSlab *)((uintptr_t)(mag) & ~(uintptr_t)(VMEM_PAGE_SIZE - 1)))
+
+/* Slabs that have free magazines, completely free ones are given back except for one */
+static VmemLock mag_lock = 0;
+static struct VmemMagSlabList mag_partial = LIST_HEAD_INITIALIZER(mag_partial);
+static size_t mag_nempty;
 
 static const char *seg_type_str[] = {
     "allocated",
     "free",
-    "span"};
+    "span",
+    "rotor",
+    "pending"};
 
 #ifdef __KERNEL__
 
-void vmem_lock(void);
-void vmem_unlock(void);
+/* Returns the index of the current CPU, in the range [0, VMEM_NCPU) */
+int vmem_cpu_id(void);
+
+/* Returns a timestamp for the latency histograms, in any unit */
+uint64_t vmem_clock(void);
 
 #else
-#    define vmem_lock()
-#    define vmem_unlock()
+
+/* In userspace, each thread is given a CPU layer slot in a round-robin fashion */
+static __thread int vmem_thread_slot = -1;
+static int vmem_next_slot = 0;
+
+static int vmem_cpu_id(void)
+{
+    if (vmem_thread_slot < 0)
+        vmem_thread_slot = __sync_fetch_and_add(&vmem_next_slot, 1) % VMEM_NCPU;
+
+    return vmem_thread_slot;
+}
+
+/* The TSC is much cheaper to read than the system clock */
+#    if defined(__x86_64__) || defined(__i386__)
+#        define vmem_clock() __builtin_ia32_rdtsc()
+#    else
+#        include <time.h>
+
+static uint64_t vmem_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+#    endif
+
+/* Pages must be naturally aligned, boundary tag slabs rely on it */
+static void *vmem_alloc_pages(size_t n)
+{
+    void *ptr;
+
+    if (posix_memalign(&ptr, VMEM_PAGE_SIZE, n * VMEM_PAGE_SIZE) != 0)
+        return NULL;
+
+    return ptr;
+}
 #endif
 
-static VmemSegment *seg_alloc(void)
+/* Adds `n` to a hot-path counter. Every event is counted with the arena lock held, next to the state it describes,
+ * so per-CPU slots wouldn't take anything off the hot path */
+#define VMEM_COUNT(vmp, counter, n) ((vmp)->counters.counter += (n))
+
+static void vmem_spin_lock(VmemLock *lock)
+{
+    while (__sync_lock_test_and_set(lock, 1))
+    {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+            ;
+    }
+}
+
+static void vmem_spin_unlock(VmemLock *lock)
+{
+    __sync_lock_release(lock);
+}
+
+static VmemMagazine *magazine_alloc(void)
+{
+    VmemMagSlab *slab;
+    VmemMagazine *mag;
+    size_t i;
+
+    vmem_spin_lock(&mag_lock);
+
+    if (LIST_EMPTY(&mag_partial))
+    {
+        vmem_spin_unlock(&mag_lock);
+        slab = vmem_alloc_pages(1);
+
+        if (slab == NULL)
+            return NULL;
+
+        LIST_INIT(&slab->freemags);
+
+        for (i = 0; i < MAG_SLAB_NMAGS; i++)
+        {
+            LIST_INSERT_HEAD(&slab->freemags, (VmemMagazine *)(slab + 1) + i, link);
+        }
+
+        slab->nfree = MAG_SLAB_NMAGS;
+
+        vmem_spin_lock(&mag_lock);
+        LIST_INSERT_HEAD(&mag_partial, slab, link);
+        mag_nempty++;
+    }
+
+    slab = LIST_FIRST(&mag_partial);
+
+    if (slab->nfree == MAG_SLAB_NMAGS)
+        mag_nempty--;
+
+    mag = LIST_FIRST(&slab->freemags);
+    LIST_REMOVE(mag, link);
+
+    if (--slab->nfree == 0)
+        LIST_REMOVE(slab, link);
+
+    vmem_spin_unlock(&mag_lock);
+
+    return mag;
+}
+
+static void magazine_free(VmemMagazine *mag)
+{
+    VmemMagSlab *slab = MAG_SLAB_OF(mag), *release = NULL;
+
+    vmem_spin_lock(&mag_lock);
+
+    if (slab->nfree == 0)
+        LIST_INSERT_HEAD(&mag_partial, slab, link);
+
+    LIST_INSERT_HEAD(&slab->freemags, mag, link);
+
+    /* Like tag slabs, give completely free slabs back to the page allocator except for one */
+    if (++slab->nfree == MAG_SLAB_NMAGS)
+    {
+        if (mag_nempty > 0)
+        {
+            LIST_REMOVE(slab, link);
+            release = slab;
+        }
+        else
+        {
+            mag_nempty++;
+        }
+    }
+
+    vmem_spin_unlock(&mag_lock);
+
+    if (release != NULL)
+        vmem_free_pages(release, 1);
+}
+
+/* Allocates a boundary tag of the given class (VMEM_TAG_*) */
+static VmemSegment *seg_alloc(int vmflag, int tagclass)
 {
-    /* TODO: when bootstrapped, allocate boundary tags dynamically as described in the paper */
-    VmemSegment *vsp;
+    VmemSegPool *pool = &seg_pools[tagclass];
+    VmemSegSlab *slab;
+    VmemSegment *vsp = NULL;
+    size_t i;
+
+    vmem_spin_lock(&seg_lock);
+
+    if (LIST_EMPTY(&pool->partial) && !(vmflag & VM_BOOTSTRAP))
+    {
+        /* Don't hold the pool lock while calling into the page allocator */
+        vmem_spin_unlock(&seg_lock);
+        slab = vmem_alloc_pages(1);
+        vmem_spin_lock(&seg_lock);
+
+        if (slab != NULL)
+        {
+            SLIST_INIT(&slab->freesegs);
+            slab->pool = pool;
+
+            for (i = 0; i < SLAB_NSEGS(pool); i++)
+            {
+                SLIST_INSERT_HEAD(&slab->freesegs, SLAB_SEG(slab, i), u.link);
+            }
+
+            slab->nfree = SLAB_NSEGS(pool);
+            LIST_INSERT_HEAD(&pool->partial, slab, link);
+            pool->nempty++;
+            seg_stat.bytes += VMEM_PAGE_SIZE;
+        }
+    }
 
-    vmem_lock();
-    ASSERT(!LIST_EMPTY(&free_segs));
-    vsp = LIST_FIRST(&free_segs);
-    LIST_REMOVE(vsp, seglist);
-    nfreesegs--;
-    vmem_unlock();
+    slab = LIST_FIRST(&pool->partial);
+
+    if (slab != NULL)
+    {
+        if (slab->nfree == SLAB_NSEGS(pool))
+            pool->nempty--;
+
+        vsp = SLIST_FIRST(&slab->freesegs);
+        SLIST_REMOVE_HEAD(&slab->freesegs, u.link);
+
+        if (--slab->nfree == 0)
+            LIST_REMOVE(slab, link);
+    }
+    else if (!SLIST_EMPTY(&reserve_segs))
+    {
+        /* The reserved tags are full-sized, they can be used for any class */
+        vsp = SLIST_FIRST(&reserve_segs);
+        SLIST_REMOVE_HEAD(&reserve_segs, u.link);
+        seg_stat.reserve--;
+    }
+
+    if (vsp != NULL && ++seg_stat.inuse > seg_stat.peak)
+        seg_stat.peak = seg_stat.inuse;
+
+    vmem_spin_unlock(&seg_lock);
 
     return vsp;
 }
 
-static void seg_free(VmemSegment *seg)
+static bool seg_is_reserved(VmemSegment *seg)
+{
+    return (uintptr_t)seg >= (uintptr_t)static_segs && (uintptr_t)seg < (uintptr_t)(static_segs + ARR_SIZE(static_segs));
+}
+
+/* Returns the class (VMEM_TAG_*) of the tag `seg`, reserved tags may be used as any class but are full-sized */
+static int seg_class(VmemSegment *seg)
 {
-    vmem_lock();
-    LIST_INSERT_HEAD(&free_segs, seg, seglist);
-    nfreesegs++;
-    vmem_unlock();
+    if (seg_is_reserved(seg))
+        return VMEM_TAG_FULL;
+
+    return SLAB_OF(seg)->pool - seg_pools;
 }
 
-static int repopulate_segments(void)
+static void seg_free(VmemSegment *seg)
 {
-    struct
+    VmemSegSlab *slab, *release = NULL;
+    VmemSegPool *pool;
+
+    vmem_spin_lock(&seg_lock);
+
+    seg_stat.inuse--;
+
+    if (seg_is_reserved(seg))
     {
-        VmemSegment segs[64];
-    } *segblock;
-    size_t i;
+        SLIST_INSERT_HEAD(&reserve_segs, seg, u.link);
+        seg_stat.reserve++;
+        vmem_spin_unlock(&seg_lock);
+        return;
+    }
 
-    if (nfreesegs >= 128)
-        return 0;
+    slab = SLAB_OF(seg);
+    pool = slab->pool;
+
+    if (slab->nfree == 0)
+        LIST_INSERT_HEAD(&pool->partial, slab, link);
 
-    /* Add 64 new segments */
-    segblock = vmem_alloc_pages(1);
+    SLIST_INSERT_HEAD(&slab->freesegs, seg, u.link);
 
-    for (i = 0; i < ARR_SIZE(segblock->segs); i++)
+    /* Give completely free slabs back to the page allocator, except for one to avoid thrashing */
+    if (++slab->nfree == SLAB_NSEGS(pool))
     {
-        seg_free(&segblock->segs[i]);
+        if (pool->nempty > 0)
+        {
+            LIST_REMOVE(slab, link);
+            release = slab;
+            seg_stat.bytes -= VMEM_PAGE_SIZE;
+        }
+        else
+        {
+            pool->nempty++;
+        }
     }
 
-    return 0;
+    vmem_spin_unlock(&seg_lock);
+
+    if (release != NULL)
+        vmem_free_pages(release, 1);
 }
 
 static int seg_fit(VmemSegment *segment, size_t size, size_t align, size_t phase, size_t nocross, uintptr_t minaddr, uintptr_t maxaddr, uintptr_t *addrp)
@@ -128,7 +412,16 @@ static int seg_fit(VmemSegment *segment, size_t size, size_t align, size_t phase
         start += align;
     }
 
-    ASSERT(nocross == 0 && "Not implemented (yet)");
+    /* The allocation must not straddle a `nocross` boundary. If it does, move it to the next boundary (keeping the alignment and phase).
+     * Since both `align` and `nocross` are powers of two, the offset from the boundary is now the smallest possible one:
+     * if it still crosses, no address in this segment can satisfy the allocation. */
+    if (nocross != 0 && VMEM_CROSSES(start, size, nocross))
+    {
+        start = VMEM_ALIGNUP(VMEM_ALIGNUP(start, nocross) - phase, align) + phase;
+
+        if (VMEM_CROSSES(start, size, nocross))
+            return -VMEM_ERR_NO_MEM;
+    }
 
     /* Ensure that `end` is bigger than `start` and we found a segment of the proper size */
     if (start <= end && (end - start) >= size)
@@ -150,414 +443,2386 @@ static uint64_t murmur64(uint64_t h)
     return h;
 }
 
-static VmemSegList *hashtable_for_addr(Vmem *vmem, uintptr_t addr)
-{
-    /* Hash the address and get the remainder */
-    uintptr_t idx = murmur64(addr) % ARR_SIZE(vmem->hashtable);
-    return &vmem->hashtable[idx];
-}
+/* Free segments are also kept in a size-ordered treap (a binary search tree that is balanced by giving
+ * each node a random priority and keeping the tree heap-ordered on it).
+ * The priority is a hash of the segment's base, which doesn't change while the segment is in the tree. */
+#define TREE_PRIO(seg) murmur64((seg)->base)
 
-static void hashtab_insert(Vmem *vmem, VmemSegment *seg)
+static int sizetree_cmp(VmemSegment *a, VmemSegment *b)
 {
-    LIST_INSERT_HEAD(hashtable_for_addr(vmem, seg->base), seg, seglist);
-}
+    if (a->size != b->size)
+        return a->size < b->size ? -1 : 1;
 
-static VmemSegList *freelist_for_size(Vmem *vmem, size_t size)
-{
-    return &vmem->freelist[GET_LIST(size) - 1];
+    if (a->base != b->base)
+        return a->base < b->base ? -1 : 1;
+
+    return 0;
 }
 
-static int vmem_contains(Vmem *vmp, void *address, size_t size)
+/* Inserts `seg` in the subtree `root`, returns the new root of the subtree */
+static VmemSegment *sizetree_insert(VmemSegment *root, VmemSegment *seg)
 {
-    VmemSegment *seg;
-    uintptr_t start = (uintptr_t)address;
-    uintptr_t end = start + size;
+    VmemSegment *child;
 
-    TAILQ_FOREACH(seg, &vmp->segqueue, segqueue)
+    if (root == NULL)
+    {
+        seg->f.tree.sleft = seg->f.tree.sright = NULL;
+        return seg;
+    }
+
+    if (sizetree_cmp(seg, root) < 0)
     {
-        if (start >= seg->base && end <= seg->base + seg->size)
+        root->f.tree.sleft = sizetree_insert(root->f.tree.sleft, seg);
+
+        /* Rotate right to restore the heap order */
+        if (TREE_PRIO(root->f.tree.sleft) > TREE_PRIO(root))
         {
-            return true;
+            child = root->f.tree.sleft;
+            root->f.tree.sleft = child->f.tree.sright;
+            child->f.tree.sright = root;
+            return child;
         }
     }
-    return false;
-}
-
-static void vmem_add_to_freelist(Vmem *vm, VmemSegment *seg)
-{
-    LIST_INSERT_HEAD(freelist_for_size(vm, seg->size), seg, seglist);
-}
+    else
+    {
+        root->f.tree.sright = sizetree_insert(root->f.tree.sright, seg);
 
-static void vmem_insert_segment(Vmem *vm, VmemSegment *seg, VmemSegment *prev)
-{
+        /* Rotate left to restore the heap order */
+        if (TREE_PRIO(root->f.tree.sright) > TREE_PRIO(root))
+        {
+            child = root->f.tree.sright;
+            root->f.tree.sright = child->f.tree.sleft;
+            child->f.tree.sleft = root;
+            return child;
+        }
+    }
 
-    TAILQ_INSERT_AFTER(&vm->segqueue, prev, seg, segqueue);
+    return root;
 }
 
-static VmemSegment *vmem_add_internal(Vmem *vmem, void *base, size_t size, bool import)
+/* Merges two subtrees, every node of `left` being smaller than every node of `right` */
+static VmemSegment *sizetree_merge(VmemSegment *left, VmemSegment *right)
 {
-    VmemSegment *newspan, *newfree;
+    if (left == NULL)
+        return right;
 
-    newspan = seg_alloc();
+    if (right == NULL)
+        return left;
 
-    ASSERT(newspan);
+    if (TREE_PRIO(left) > TREE_PRIO(right))
+    {
+        left->f.tree.sright = sizetree_merge(left->f.tree.sright, right);
+        return left;
+    }
 
-    newspan->base = (uintptr_t)base;
-    newspan->size = size;
-    newspan->type = SEGMENT_SPAN;
-    newspan->imported = import;
+    right->f.tree.sleft = sizetree_merge(left, right->f.tree.sleft);
+    return right;
+}
 
-    newfree = seg_alloc();
+/* Removes `seg` from the subtree `root`, returns the new root of the subtree */
+static VmemSegment *sizetree_remove(VmemSegment *root, VmemSegment *seg)
+{
+    int cmp;
 
-    ASSERT(newfree);
+    ASSERT(root != NULL);
 
-    newfree->base = (uintptr_t)base;
-    newfree->size = size;
-    newfree->type = SEGMENT_FREE;
+    cmp = sizetree_cmp(seg, root);
 
-    TAILQ_INSERT_TAIL(&vmem->segqueue, newspan, segqueue);
-    vmem_insert_segment(vmem, newfree, newspan);
-    vmem_add_to_freelist(vmem, newfree);
+    if (cmp < 0)
+        root->f.tree.sleft = sizetree_remove(root->f.tree.sleft, seg);
+    else if (cmp > 0)
+        root->f.tree.sright = sizetree_remove(root->f.tree.sright, seg);
+    else
+        return sizetree_merge(root->f.tree.sleft, root->f.tree.sright);
 
-    return newfree;
+    return root;
 }
 
-static int vmem_import(Vmem *vmp, size_t size, int vmflag)
+/* Returns the smallest free segment whose (size, base) is at least (size, base), or NULL */
+static VmemSegment *sizetree_ceil(VmemSegment *root, uintptr_t size, uintptr_t base)
 {
-    void *addr;
-    VmemSegment *new_seg;
-    if (!vmp->alloc)
-        return -VMEM_ERR_NO_MEM;
-
-    addr = vmp->alloc(vmp->source, size, vmflag);
-
-    if (!addr)
-        return -VMEM_ERR_NO_MEM;
-
-    new_seg = vmem_add_internal(vmp, addr, size, true);
+    VmemSegment *best = NULL;
 
-    if (!new_seg)
+    while (root != NULL)
     {
-        vmp->free(vmp->source, addr, size);
+        if (root->size > size || (root->size == size && root->base >= base))
+        {
+            best = root;
+            root = root->f.tree.sleft;
+        }
+        else
+        {
+            root = root->f.tree.sright;
+        }
     }
 
-    return 0;
+    return best;
 }
 
-int vmem_init(Vmem *ret, char *name, void *base, size_t size, size_t quantum, VmemAlloc *afunc, VmemFree *ffunc, Vmem *source, size_t qcache_max, int vmflag)
+/* The address tree is a treap too, augmented with the size of the biggest free segment of each subtree
+ * so that searches can skip the subtrees that can't satisfy an allocation */
+static VmemSegment *addrtree_update(VmemSegment *seg)
 {
-    size_t i;
+    seg->u.amax = seg->size;
 
-    strcpy(ret->name, name);
+    if (seg->f.tree.aleft != NULL)
+        seg->u.amax = MAX(seg->u.amax, seg->f.tree.aleft->u.amax);
 
-    ret->base = base;
-    ret->size = size;
-    ret->quantum = quantum;
-    ret->alloc = afunc;
-    ret->free = ffunc;
-    ret->source = source;
-    ret->qcache_max = qcache_max;
-    ret->vmflag = vmflag;
-    ret->stat.free = size;
-    ret->stat.total += size;
-    ret->stat.in_use = 0;
-    ret->stat.import = 0;
+    if (seg->f.tree.aright != NULL)
+        seg->u.amax = MAX(seg->u.amax, seg->f.tree.aright->u.amax);
 
-    LIST_INIT(&ret->spanlist);
-    TAILQ_INIT(&ret->segqueue);
+    return seg;
+}
 
-    for (i = 0; i < ARR_SIZE(ret->freelist); i++)
+static VmemSegment *addrtree_insert(VmemSegment *root, VmemSegment *seg)
+{
+    VmemSegment *child;
+
+    if (root == NULL)
     {
-        LIST_INIT(&ret->freelist[i]);
+        seg->f.tree.aleft = seg->f.tree.aright = NULL;
+        return addrtree_update(seg);
     }
 
-    for (i = 0; i < ARR_SIZE(ret->hashtable); i++)
+    if (seg->base < root->base)
     {
-        LIST_INIT(&ret->hashtable[i]);
+        root->f.tree.aleft = addrtree_insert(root->f.tree.aleft, seg);
+
+        if (TREE_PRIO(root->f.tree.aleft) > TREE_PRIO(root))
+        {
+            child = root->f.tree.aleft;
+            root->f.tree.aleft = child->f.tree.aright;
+            child->f.tree.aright = addrtree_update(root);
+            return addrtree_update(child);
+        }
     }
+    else
+    {
+        root->f.tree.aright = addrtree_insert(root->f.tree.aright, seg);
 
-    /* Add initial span */
-    if (!source && size)
-        vmem_add(ret, base, size, vmflag);
+        if (TREE_PRIO(root->f.tree.aright) > TREE_PRIO(root))
+        {
+            child = root->f.tree.aright;
+            root->f.tree.aright = child->f.tree.aleft;
+            child->f.tree.aleft = addrtree_update(root);
+            return addrtree_update(child);
+        }
+    }
 
-    return 0;
+    return addrtree_update(root);
 }
 
-void vmem_destroy(Vmem *vmp)
+static VmemSegment *addrtree_merge(VmemSegment *left, VmemSegment *right)
 {
-    VmemSegment *seg;
-    size_t i;
+    if (left == NULL)
+        return right;
 
-    for (i = 0; i < sizeof(vmp->hashtable) / sizeof(*vmp->hashtable); i++)
-        ASSERT(LIST_EMPTY(&vmp->hashtable[i]));
+    if (right == NULL)
+        return left;
 
-    TAILQ_FOREACH(seg, &vmp->segqueue, segqueue)
+    if (TREE_PRIO(left) > TREE_PRIO(right))
     {
-        seg_free(seg);
+        left->f.tree.aright = addrtree_merge(left->f.tree.aright, right);
+        return addrtree_update(left);
     }
+
+    right->f.tree.aleft = addrtree_merge(left, right->f.tree.aleft);
+    return addrtree_update(right);
 }
 
-void *vmem_add(Vmem *vmp, void *addr, size_t size, int vmflag)
+static VmemSegment *addrtree_remove(VmemSegment *root, VmemSegment *seg)
 {
-    ASSERT(!vmem_contains(vmp, addr, size));
+    ASSERT(root != NULL);
 
-    vmp->stat.free += size;
-    vmp->stat.total += size;
-    (void)vmflag;
-    return vmem_add_internal(vmp, addr, size, false);
+    if (seg->base < root->base)
+        root->f.tree.aleft = addrtree_remove(root->f.tree.aleft, seg);
+    else if (seg->base > root->base)
+        root->f.tree.aright = addrtree_remove(root->f.tree.aright, seg);
+    else
+        return addrtree_merge(root->f.tree.aleft, root->f.tree.aright);
+
+    return addrtree_update(root);
 }
 
-void *vmem_xalloc(Vmem *vmp, size_t size, size_t align, size_t phase,
-                  size_t nocross, void *minaddr, void *maxaddr, int vmflag)
+/* Returns the lowest free segment of the subtree `root` that is at least `need` bytes and can satisfy the allocation, or NULL.
+ * Subtrees whose biggest segment is smaller than `need` or that are outside of [minaddr, maxaddr) are skipped.
+ * Big enough segments that didn't fit are counted in `rejects`. */
+static VmemSegment *addrtree_fit(VmemSegment *root, size_t need, size_t size, size_t align, size_t phase, size_t nocross, uintptr_t minaddr, uintptr_t maxaddr, uintptr_t *addrp, size_t *rejects)
 {
-    VmemSegList *first_list = freelist_for_size(vmp, size), *end = &vmp->freelist[FREELISTS_N], *list = NULL;
-    VmemSegment *new_seg = NULL, *new_seg2 = NULL, *seg = NULL;
-    uintptr_t start = 0;
-    void *ret = NULL;
+    VmemSegment *seg;
 
-    ASSERT(nocross == 0 && "Not implemented yet");
+    if (root == NULL || root->u.amax < need)
+        return NULL;
 
-    /* If we don't want a specific alignment, we can just use the quantum */
-    /* FIXME: What if `align` is not quantum aligned? Maybe add an ASSERT() ? */
+    /* Segments on the left end before `root` starts */
+    if (root->base > minaddr && (seg = addrtree_fit(root->f.tree.aleft, need, size, align, phase, nocross, minaddr, maxaddr, addrp, rejects)) != NULL)
+        return seg;
 
-    if (align == 0)
+    if (root->size >= need)
     {
-        align = vmp->quantum;
+        if (seg_fit(root, size, align, phase, nocross, minaddr, maxaddr, addrp) == 0)
+            return root;
+
+        (*rejects)++;
     }
 
-    if (!(vmflag & VM_BOOTSTRAP))
-        ASSERT(repopulate_segments() == 0);
+    /* Segments on the right start after `root` ends */
+    if (root->base + root->size < maxaddr)
+        return addrtree_fit(root->f.tree.aright, need, size, align, phase, nocross, minaddr, maxaddr, addrp, rejects);
 
-    /* Allocate the new segments */
-    /* NOTE: new_seg2 might be unused, in that case, it is freed */
-    new_seg = seg_alloc();
-    new_seg2 = seg_alloc();
+    return NULL;
+}
 
-    ASSERT(new_seg && new_seg2);
+static VmemSegSList *hashtable_for_addr(Vmem *vmem, uintptr_t addr)
+{
+    /* Hash the address and get the remainder */
+    uint64_t hash = murmur64(addr);
+    uintptr_t idx;
 
-    while (true)
+    /* Buckets of the old hashtable that haven't been migrated yet are still in use */
+    if (vmem->oldhash != NULL)
     {
-        if (vmflag & VM_INSTANTFIT) /* VM_INSTANTFIT */
-        {
-            /* If the size is not a power of two, use freelist[n+1] instead of freelist[n] */
-            if ((size & (size - 1)) != 0)
-            {
-                first_list++;
-            }
+        idx = hash & (vmem->oldhashsize - 1);
 
-            /* We just get the first segment from the list. This ensures constant-time allocation.
-             * Note that we do not need to check the size of the segments because they are guaranteed to be big enough (see freelist_for_size)
-             */
-            for (list = first_list; list < end; list++)
-            {
-                seg = LIST_FIRST(list);
-                if (seg != NULL)
-                {
-                    if (seg_fit(seg, size, align, phase, nocross, (uintptr_t)minaddr, (uintptr_t)maxaddr, &start) == 0)
-                        goto found;
-                }
+        if (idx >= vmem->rehash_pos)
+            return &vmem->oldhash[idx];
+    }
+
+    idx = hash & (vmem->hashsize - 1);
+    return &vmem->hashtable[idx];
+}
+
+static size_t hashtab_pages(size_t size)
+{
+    return (size * sizeof(VmemSegSList) + VMEM_PAGE_SIZE - 1) / VMEM_PAGE_SIZE;
+}
+
+/* Migrates a few buckets of the old hashtable, so that no single operation pays for the whole resize.
+ * Never allocates or frees pages: that's left to hashtab_resize(), so that vmem_free can't block or fail. */
+static void hashtab_rehash(Vmem *vmem)
+{
+    VmemSegment *seg;
+    VmemSegSList *bucket;
+    size_t i;
+
+    if (vmem->oldhash == NULL)
+        return;
+
+    for (i = 0; i < VMEM_REHASH_STEP && vmem->rehash_pos < vmem->oldhashsize; i++)
+    {
+        bucket = &vmem->oldhash[vmem->rehash_pos++];
+
+        while ((seg = SLIST_FIRST(bucket)) != NULL)
+        {
+            SLIST_REMOVE_HEAD(bucket, u.link);
+            SLIST_INSERT_HEAD(hashtable_for_addr(vmem, seg->base), seg, u.link);
+        }
+    }
+}
+
+/* Frees the old hashtable once it's migrated, or starts resizing the hashtable if its load factor is too high or too low.
+ * Only called by allocations, with the arena lock held. The lock is dropped while allocating or freeing a table. */
+static void hashtab_resize(Vmem *vmem)
+{
+    VmemSegSList *table;
+    size_t i, size, oldsize = vmem->hashsize;
+
+    if (vmem->oldhash != NULL)
+    {
+        if (vmem->rehash_pos < vmem->oldhashsize)
+            return;
+
+        table = vmem->oldhash;
+        size = vmem->oldhashsize;
+        vmem->oldhash = NULL;
+
+        if (table != vmem->hash0)
+        {
+            vmem_spin_unlock(&vmem->lock);
+            vmem_free_pages(table, hashtab_pages(size));
+            vmem_spin_lock(&vmem->lock);
+        }
+
+        return;
+    }
+
+    if (vmem->nalloc > vmem->hashsize * 2)
+        size = vmem->hashsize * 4;
+    else if (vmem->hashsize > HASHTABLES_N && vmem->nalloc < vmem->hashsize / 8)
+        size = MAX(vmem->hashsize / 4, HASHTABLES_N);
+    else
+        return;
+
+    if (size == HASHTABLES_N)
+    {
+        table = vmem->hash0;
+    }
+    else
+    {
+        vmem_spin_unlock(&vmem->lock);
+        table = vmem_alloc_pages(hashtab_pages(size));
+        vmem_spin_lock(&vmem->lock);
+
+        /* If we can't get a new table, keep using the current one, it's only slower */
+        if (table == NULL)
+            return;
+
+        /* Another allocation may have started a resize while the lock was dropped */
+        if (vmem->oldhash != NULL || vmem->hashsize != oldsize)
+        {
+            vmem_spin_unlock(&vmem->lock);
+            vmem_free_pages(table, hashtab_pages(size));
+            vmem_spin_lock(&vmem->lock);
+            return;
+        }
+    }
+
+    for (i = 0; i < size; i++)
+    {
+        SLIST_INIT(&table[i]);
+    }
+
+    vmem->oldhash = vmem->hashtable;
+    vmem->oldhashsize = vmem->hashsize;
+    vmem->rehash_pos = 0;
+    vmem->hashtable = table;
+    vmem->hashsize = size;
+}
+
+static void hashtab_insert(Vmem *vmem, VmemSegment *seg)
+{
+    SLIST_INSERT_HEAD(hashtable_for_addr(vmem, seg->base), seg, u.link);
+    vmem->nalloc++;
+    hashtab_rehash(vmem);
+}
+
+/* Removes the allocated segment that starts at `addr` from the hashtable and returns it */
+static VmemSegment *hashtab_remove(Vmem *vmem, uintptr_t addr)
+{
+    VmemSegSList *bucket = hashtable_for_addr(vmem, addr);
+    VmemSegment *seg, *prev = NULL;
+    size_t walked = 1;
+
+    SLIST_FOREACH(seg, bucket, u.link)
+    {
+        if (seg->base == addr)
+            break;
+
+        prev = seg;
+        walked++;
+    }
+
+    VMEM_COUNT(vmem, hash_walked, walked);
+
+    if (seg == NULL)
+        return NULL;
+
+    /* The buckets are singly linked, unlink the segment from its predecessor */
+    if (prev == NULL)
+        SLIST_REMOVE_HEAD(bucket, u.link);
+    else
+        SLIST_NEXT(prev, u.link) = SLIST_NEXT(seg, u.link);
+
+    vmem->nalloc--;
+    hashtab_rehash(vmem);
+
+    return seg;
+}
+
+static int vmem_contains(Vmem *vmp, void *address, size_t size)
+{
+    VmemSegment *seg;
+    uintptr_t start = (uintptr_t)address;
+    uintptr_t end = start + size;
+
+    TAILQ_FOREACH(seg, &vmp->segqueue, segqueue)
+    {
+        if (seg->type == SEGMENT_SPAN && start >= seg->base && end <= seg->base + seg->size)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* freelist[n] holds the segments whose sizes are in [2^n, 2^(n+1)), this also works for a size of 1.
+ * Once the arena has trees, the segments are only inserted in them: keeping both would cost the tree updates
+ * on top of the list ones, and the segments of a freelist follow each other in the size tree anyway. */
+static void vmem_add_to_freelist(Vmem *vm, VmemSegment *seg)
+{
+    size_t n = GET_LIST(seg->size);
+
+    if (vm->trees)
+    {
+        vm->sizetree = sizetree_insert(vm->sizetree, seg);
+        vm->addrtree = addrtree_insert(vm->addrtree, seg);
+    }
+    else
+    {
+        LIST_INSERT_HEAD(&vm->freelist[n], seg, f.seglist);
+    }
+
+    vm->freemap |= (uintptr_t)1 << n;
+    vm->stat.freesegs++;
+    vm->stat.freelist_segs[n]++;
+    vm->stat.freelist_bytes[n] += seg->size;
+}
+
+/* Every removal from a freelist must go through this function to keep `freemap` and the trees up to date */
+static void vmem_remove_from_freelist(Vmem *vm, VmemSegment *seg)
+{
+    size_t n = GET_LIST(seg->size);
+
+    if (vm->trees)
+    {
+        vm->sizetree = sizetree_remove(vm->sizetree, seg);
+        vm->addrtree = addrtree_remove(vm->addrtree, seg);
+    }
+    else
+    {
+        LIST_REMOVE(seg, f.seglist);
+    }
+
+    vm->stat.freesegs--;
+    vm->stat.freelist_segs[n]--;
+    vm->stat.freelist_bytes[n] -= seg->size;
+
+    if (vm->stat.freelist_segs[n] == 0)
+        vm->freemap &= ~((uintptr_t)1 << n);
+}
+
+/* Moves the free segments of `vmp` from the freelists to the trees. This is done the first time a request needs
+ * them, so that arenas only ever used with VM_INSTANTFIT don't pay for the trees on every free and allocation. */
+static void vmem_build_trees(Vmem *vmp)
+{
+    VmemSegment *seg;
+    size_t i;
+
+    for (i = 0; i < FREELISTS_N; i++)
+    {
+        /* The tree links overwrite the list links, so each segment is unlinked first */
+        while ((seg = LIST_FIRST(&vmp->freelist[i])) != NULL)
+        {
+            LIST_REMOVE(seg, f.seglist);
+            vmp->sizetree = sizetree_insert(vmp->sizetree, seg);
+            vmp->addrtree = addrtree_insert(vmp->addrtree, seg);
+        }
+    }
+
+    vmp->trees = true;
+}
+
+/* Returns the most recently freed segment of freelist[n], or the smallest one once the arena has trees */
+static VmemSegment *vmem_freelist_head(Vmem *vmp, size_t n)
+{
+    if (vmp->trees)
+        return sizetree_ceil(vmp->sizetree, (uintptr_t)1 << n, 0);
+
+    return LIST_FIRST(&vmp->freelist[n]);
+}
+
+static void vmem_insert_segment(Vmem *vm, VmemSegment *seg, VmemSegment *prev)
+{
+
+    TAILQ_INSERT_AFTER(&vm->segqueue, prev, seg, segqueue);
+}
+
+/* Fills the arena's tag reserves up to VMEM_SEGS_MIN so that nothing in the allocation path can run out of tags.
+ * Must be called with the arena lock held, the lock is dropped while refilling. */
+static int vmem_populate(Vmem *vmp, int vmflag)
+{
+    VmemSegment *seg;
+    int i;
+
+    for (i = 0; i < VMEM_TAG_CLASSES; i++)
+    {
+        if (vmp->nfreesegs[i] >= VMEM_SEGS_MIN)
+            continue;
+
+        vmem_spin_unlock(&vmp->lock);
+        seg = seg_alloc(vmflag, i);
+        vmem_spin_lock(&vmp->lock);
+
+        if (seg == NULL)
+            return -VMEM_ERR_NO_MEM;
+
+        SLIST_INSERT_HEAD(&vmp->freesegs[i], seg, u.link);
+        vmp->nfreesegs[i]++;
+        VMEM_COUNT(vmp, populates, 1);
+
+        /* Other users may have taken tags of any class while the lock was dropped, check them all again */
+        i = -1;
+    }
+
+    return 0;
+}
+
+/* Takes a tag of the given class from the arena's reserve, the caller must have called vmem_populate() */
+static VmemSegment *vmem_seg_get(Vmem *vmp, int tagclass)
+{
+    VmemSegment *seg = SLIST_FIRST(&vmp->freesegs[tagclass]);
+
+    ASSERT(seg != NULL);
+    SLIST_REMOVE_HEAD(&vmp->freesegs[tagclass], u.link);
+    vmp->nfreesegs[tagclass]--;
+
+    return seg;
+}
+
+/* Gives a tag back to the arena's reserve, or to the global pool if the reserve is full */
+static void vmem_seg_put(Vmem *vmp, VmemSegment *seg)
+{
+    int tagclass = seg_class(seg);
+
+    if (vmp->nfreesegs[tagclass] >= VMEM_SEGS_MAX)
+    {
+        seg_free(seg);
+        return;
+    }
+
+    SLIST_INSERT_HEAD(&vmp->freesegs[tagclass], seg, u.link);
+    vmp->nfreesegs[tagclass]++;
+}
+
+/* Unlocked check for a trace, the buffer itself is only used after vmem_trace() has announced its write */
+#define VMEM_TRACING(vmp) (__atomic_load_n(&(vmp)->trace, __ATOMIC_RELAXED) != NULL)
+
+/* Appends the `n` events of `evs` to the trace of `vmp`, if it's being traced. The slots are reserved all at once,
+ * so that the constraints of a vmem_xalloc() stay right before it, and atomically since the quantum caches record
+ * their events without the arena lock. Frees are recorded before the resource is given back and allocations after
+ * it's been taken, so an address is never seen allocated twice. A writer that falls a whole ring behind another may
+ * overwrite its event, traces are meant to be much bigger than that. */
+static void vmem_trace(Vmem *vmp, const VmemTraceEvent *evs, size_t n)
+{
+    VmemTraceEvent *trace;
+    size_t pos, ring, i;
+
+    if (!VMEM_TRACING(vmp))
+        return;
+
+    /* Announce the write before looking at the buffer again: either vmem_trace_stop() waits for it, or it's already
+     * cleared the buffer and we see NULL (both sides are sequentially consistent) */
+    __sync_fetch_and_add(&vmp->tracers, 1);
+    trace = __atomic_load_n(&vmp->trace, __ATOMIC_SEQ_CST);
+
+    if (trace != NULL)
+    {
+        ring = vmp->tracesize - vmp->tracehead;
+        pos = __sync_fetch_and_add(&vmp->tracepos, n);
+
+        for (i = 0; i < n; i++)
+            trace[vmp->tracehead + (pos + i) % ring] = evs[i];
+    }
+
+    __sync_fetch_and_sub(&vmp->tracers, 1);
+}
+
+static void vmem_trace_event(Vmem *vmp, int type, int vmflag, uintptr_t addr, size_t size)
+{
+    VmemTraceEvent ev;
+
+    if (!VMEM_TRACING(vmp))
+        return;
+
+    ev.type = type;
+    ev.vmflag = vmflag;
+    ev.addr = addr;
+    ev.size = size;
+    vmem_trace(vmp, &ev, 1);
+}
+
+static void vmem_trace_reverse(VmemTraceEvent *evs, size_t n)
+{
+    VmemTraceEvent tmp;
+    size_t i;
+
+    for (i = 0; i < n / 2; i++)
+    {
+        tmp = evs[i];
+        evs[i] = evs[n - 1 - i];
+        evs[n - 1 - i] = tmp;
+    }
+}
+
+/* Returns true if the free segment `seg` covers a whole imported span, that isn't idle already */
+static bool vmem_span_is_free(Vmem *vmp, VmemSegment *seg)
+{
+    VmemSegment *span = TAILQ_PREV(seg, VmemSegQueue, segqueue);
+
+    return vmp->free != NULL && span->type == SEGMENT_SPAN && span->imported && !span->idle && span->size == seg->size;
+}
+
+/* Removes `span` from the idle spans, because it's about to be used or given back */
+static void vmem_span_busy(Vmem *vmp, VmemSegment *span)
+{
+    LIST_REMOVE(span, f.spanlist);
+    span->idle = false;
+    vmp->nidle--;
+    vmp->idlebytes -= span->size;
+}
+
+/* Gives the imported span covered by the free segment `seg` (which must not be in a freelist) back to the source.
+ * Must be called with the arena lock held, the lock is dropped while calling into the source. */
+static void vmem_release_span(Vmem *vmp, VmemSegment *seg)
+{
+    VmemSegment *span = TAILQ_PREV(seg, VmemSegQueue, segqueue);
+    uintptr_t span_addr = seg->base;
+    size_t span_size = seg->size;
+
+    TAILQ_REMOVE(&vmp->segqueue, seg, segqueue);
+    vmem_seg_put(vmp, seg);
+    TAILQ_REMOVE(&vmp->segqueue, span, segqueue);
+    vmem_seg_put(vmp, span);
+
+    vmp->stat.free -= span_size;
+    vmp->stat.import -= span_size;
+    vmp->stat.total -= span_size;
+
+    vmem_trace_event(vmp, VMEM_TRACE_RELEASE, 0, span_addr, span_size);
+    VMEM_COUNT(vmp, releases, 1);
+
+    /* Spans are being given back, the next imports don't need to be as big */
+    vmp->import_next = MAX(vmp->import_next / 2, vmp->import_min);
+
+    /* The span is no longer reachable from the arena, give it back without holding the lock */
+    vmem_spin_unlock(&vmp->lock);
+    vmp->free(vmp->source, (void *)span_addr, span_size);
+    vmem_spin_lock(&vmp->lock);
+}
+
+/* Called when the free segment `seg` (which must not be in a freelist) becomes a whole imported span.
+ * The span is kept for the next allocations if the retention limits allow it, else it's given back to the source. */
+static void vmem_span_freed(Vmem *vmp, VmemSegment *seg)
+{
+    VmemSegment *span = TAILQ_PREV(seg, VmemSegQueue, segqueue);
+
+    if (vmp->nidle < vmp->idle_max && vmp->idlebytes + span->size <= vmp->idle_max_bytes)
+    {
+        span->idle = true;
+        span->u.idlegen = vmp->reapgen;
+        LIST_INSERT_HEAD(&vmp->spanlist, span, f.spanlist);
+        vmp->nidle++;
+        vmp->idlebytes += span->size;
+
+        vmem_add_to_freelist(vmp, seg);
+        return;
+    }
+
+    vmem_release_span(vmp, seg);
+}
+
+/* Gives back the idle spans that became idle before reap generation `gen` (all of them if `gen` is ~0).
+ * Must be called with the arena lock held, the lock is dropped while calling into the source. */
+static void vmem_release_idle(Vmem *vmp, unsigned long gen)
+{
+    VmemSegment *span, *seg;
+
+    while (true)
+    {
+        /* The lock is dropped by every release, so the list is searched from the start each time; it's short anyway */
+        LIST_FOREACH(span, &vmp->spanlist, f.spanlist)
+        {
+            if (span->u.idlegen < gen)
+                break;
+        }
+
+        if (span == NULL)
+            break;
+
+        seg = TAILQ_NEXT(span, segqueue);
+        vmem_span_busy(vmp, span);
+        vmem_remove_from_freelist(vmp, seg);
+        vmem_release_span(vmp, seg);
+    }
+}
+
+/* Moves the rotor right after `afterme` */
+static void vmem_advance(Vmem *vmp, VmemSegment *afterme)
+{
+    VmemSegment *rotor = &vmp->rotor;
+    VmemSegment *prev = TAILQ_PREV(rotor, VmemSegQueue, segqueue);
+    VmemSegment *next = TAILQ_NEXT(rotor, segqueue);
+    VmemSegment *seg = NULL;
+
+    TAILQ_REMOVE(&vmp->segqueue, rotor, segqueue);
+    TAILQ_INSERT_AFTER(&vmp->segqueue, afterme, rotor, segqueue);
+
+    /* The rotor may have prevented its neighbors from coalescing, if so, coalesce them now */
+    if (prev != NULL && prev->type == SEGMENT_FREE)
+    {
+        if (next != NULL && next->type == SEGMENT_FREE)
+        {
+            vmem_remove_from_freelist(vmp, prev);
+            vmem_remove_from_freelist(vmp, next);
+            TAILQ_REMOVE(&vmp->segqueue, next, segqueue);
+
+            prev->size += next->size;
+            vmem_seg_put(vmp, next);
+
+            vmem_add_to_freelist(vmp, prev);
+        }
+
+        seg = prev;
+    }
+    else if (next != NULL && next->type == SEGMENT_FREE)
+    {
+        seg = next;
+    }
+
+    /* The rotor may also have prevented an imported span from being given back */
+    if (seg != NULL && vmem_span_is_free(vmp, seg))
+    {
+        vmem_remove_from_freelist(vmp, seg);
+        vmem_span_freed(vmp, seg);
+    }
+}
+
+/* Must be called with the arena lock held, after vmem_populate() */
+static VmemSegment *vmem_add_internal(Vmem *vmem, void *base, size_t size, bool import)
+{
+    VmemSegment *newspan, *newfree;
+
+    newspan = vmem_seg_get(vmem, VMEM_TAG_FULL);
+
+    newspan->base = (uintptr_t)base;
+    newspan->size = size;
+    newspan->type = SEGMENT_SPAN;
+    newspan->imported = import;
+    newspan->idle = false;
+
+    newfree = vmem_seg_get(vmem, VMEM_TAG_FULL);
+
+    newfree->base = (uintptr_t)base;
+    newfree->size = size;
+    newfree->type = SEGMENT_FREE;
+
+    TAILQ_INSERT_TAIL(&vmem->segqueue, newspan, segqueue);
+    vmem_insert_segment(vmem, newfree, newspan);
+    vmem_add_to_freelist(vmem, newfree);
+
+    return newfree;
+}
+
+/* Imports a span of `size` bytes from the source arena, and sets `segp` to the free segment covering it.
+ * Must be called with the arena lock held; the lock is dropped while calling into the source,
+ * so the caller must re-validate anything it looked at before. */
+static int vmem_import(Vmem *vmp, size_t size, int vmflag, VmemSegment **segp)
+{
+    size_t quantum, want;
+    void *addr;
+
+    if (!vmp->alloc)
+        return -VMEM_ERR_NO_MEM;
+
+    /* Import more than needed so that the next allocations don't have to, rounded to the source's quantum */
+    quantum = vmp->source != NULL ? vmp->source->quantum : vmp->quantum;
+    want = (MAX(size, vmp->import_next) + quantum - 1) / quantum * quantum;
+    size = (size + quantum - 1) / quantum * quantum;
+
+    /* The source may be slow (or may import itself), don't make the other users of this arena wait for it */
+    vmem_spin_unlock(&vmp->lock);
+
+    /* The bigger span is only an optimization: don't wait for it, fall back to what's really needed */
+    addr = want > size ? vmp->alloc(vmp->source, want, vmflag | VM_NOSLEEP) : NULL;
+
+    if (addr != NULL)
+        size = want;
+    else
+        addr = vmp->alloc(vmp->source, size, vmflag);
+
+    vmem_spin_lock(&vmp->lock);
+
+    if (!addr)
+        return -VMEM_ERR_NO_MEM;
+
+    if (vmp->import_next != 0)
+        vmp->import_next = MIN(vmp->import_next * 2, vmp->import_max);
+
+    /* Other users may have drained the tag reserve while the lock was dropped */
+    if (vmem_populate(vmp, vmflag) != 0)
+    {
+        vmem_spin_unlock(&vmp->lock);
+        vmp->free(vmp->source, addr, size);
+        vmem_spin_lock(&vmp->lock);
+        return -VMEM_ERR_NO_MEM;
+    }
+
+    *segp = vmem_add_internal(vmp, addr, size, true);
+    vmem_trace_event(vmp, VMEM_TRACE_IMPORT, 0, (uintptr_t)addr, size);
+    VMEM_COUNT(vmp, imports, 1);
+
+    vmp->stat.import += size;
+    vmp->stat.total += size;
+    vmp->stat.free += size;
+
+    return 0;
+}
+
+static void *vmem_xalloc_locked(Vmem *vmp, size_t size, size_t align, size_t phase, size_t nocross, void *minaddr, void *maxaddr, int vmflag);
+static void vmem_xfree_locked(Vmem *vmp, void *addr, size_t size);
+static int vmem_free_pending(Vmem *vmp, int vmflag);
+
+static size_t vmem_hist_bucket(unsigned long t)
+{
+    int log;
+
+    if (t < (1UL << VMEM_HIST_SUB_BITS))
+        return t;
+
+    /* The power of two range, then the sub-bucket given by the bits right below the highest one */
+    log = sizeof(t) * CHAR_BIT - 1 - __builtin_clzl(t);
+    return ((size_t)(log - VMEM_HIST_SUB_BITS + 1) << VMEM_HIST_SUB_BITS) +
+           ((t >> (log - VMEM_HIST_SUB_BITS)) & ((1UL << VMEM_HIST_SUB_BITS) - 1));
+}
+
+/* Operations are timed outside of the arena lock, so concurrent ones record at the same time */
+static void vmem_hist_record(VmemHistogram *hist, unsigned long t)
+{
+    unsigned long max;
+
+    __sync_fetch_and_add(&hist->count, 1);
+    __sync_fetch_and_add(&hist->sum, t);
+    __sync_fetch_and_add(&hist->buckets[vmem_hist_bucket(t)], 1);
+
+    while ((max = hist->max) < t && !__sync_bool_compare_and_swap(&hist->max, max, t))
+        ;
+}
+
+/* Allocates from the arena itself, bypassing the quantum caches */
+static void *vmem_arena_alloc(Vmem *vmp, size_t size, size_t align, size_t phase, size_t nocross, void *minaddr, void *maxaddr, int vmflag)
+{
+    bool timed = vmp->timed;
+    uint64_t start = timed ? vmem_clock() : 0;
+    void *ret;
+
+    vmem_spin_lock(&vmp->lock);
+    ret = vmem_xalloc_locked(vmp, size, align, phase, nocross, minaddr, maxaddr, vmflag);
+    vmem_spin_unlock(&vmp->lock);
+
+    if (timed)
+        vmem_hist_record(&vmp->hist_alloc, vmem_clock() - start);
+
+    return ret;
+}
+
+/* Frees to the arena itself, bypassing the quantum caches */
+static void vmem_arena_free(Vmem *vmp, void *addr, size_t size)
+{
+    bool timed = vmp->timed;
+    uint64_t start = timed ? vmem_clock() : 0;
+
+    vmem_spin_lock(&vmp->lock);
+    vmem_xfree_locked(vmp, addr, size);
+    vmem_spin_unlock(&vmp->lock);
+
+    if (timed)
+        vmem_hist_record(&vmp->hist_free, vmem_clock() - start);
+}
+
+static VmemQCache *qcache_for_size(Vmem *vmp, size_t size)
+{
+    return &vmp->qcache[(size - 1) / vmp->quantum];
+}
+
+/* Returns the number of quantum caches of `vmp` */
+static size_t qcache_count(Vmem *vmp)
+{
+    return vmp->qcache_max != 0 ? vmp->qcache_max / vmp->quantum : 0;
+}
+
+/* The quantum caches of an arena are followed by their CPU layers, starting on a cache line */
+static size_t qcache_cpu_offset(size_t n)
+{
+    return (n * sizeof(VmemQCache) + VMEM_CACHE_LINE - 1) / VMEM_CACHE_LINE * VMEM_CACHE_LINE;
+}
+
+static size_t qcache_pages(size_t n)
+{
+    return (qcache_cpu_offset(n) + n * VMEM_NCPU * sizeof(VmemCpuCache) + VMEM_PAGE_SIZE - 1) / VMEM_PAGE_SIZE;
+}
+
+/* Takes a full or empty magazine from the depot, returns NULL if there's none */
+static VmemMagazine *depot_alloc(VmemDepot *depot, bool full)
+{
+    VmemMagazine *mag;
+
+    vmem_spin_lock(&depot->lock);
+
+    mag = LIST_FIRST(full ? &depot->full : &depot->empty);
+
+    if (mag != NULL)
+    {
+        LIST_REMOVE(mag, link);
+
+        /* Update the working set */
+        if (full && --depot->nfull < depot->fullmin)
+            depot->fullmin = depot->nfull;
+        else if (!full && --depot->nempty < depot->emptymin)
+            depot->emptymin = depot->nempty;
+    }
+
+    vmem_spin_unlock(&depot->lock);
+
+    return mag;
+}
+
+static void depot_free(VmemDepot *depot, VmemMagazine *mag, bool full)
+{
+    vmem_spin_lock(&depot->lock);
+
+    if (full)
+    {
+        LIST_INSERT_HEAD(&depot->full, mag, link);
+        depot->nfull++;
+    }
+    else
+    {
+        LIST_INSERT_HEAD(&depot->empty, mag, link);
+        depot->nempty++;
+    }
+
+    vmem_spin_unlock(&depot->lock);
+}
+
+static void qcache_swap(VmemCpuCache *ccp)
+{
+    VmemMagazine *mag = ccp->loaded;
+    int rounds = ccp->rounds;
+
+    ccp->loaded = ccp->previous;
+    ccp->rounds = ccp->prounds;
+    ccp->previous = mag;
+    ccp->prounds = rounds;
+}
+
+/* Fills `mag` with up to `n` objects allocated from the arena, returns the number of rounds.
+ * The arena lock is only taken once for the whole magazine. Only the first round is needed by the caller,
+ * the others are allocated with VM_NOSLEEP so that a short arena gives fewer rounds instead of failing. */
+static int qcache_fill(Vmem *vmp, VmemQCache *qc, VmemMagazine *mag, int n, int vmflag)
+{
+    int rounds;
+
+    vmem_spin_lock(&vmp->lock);
+
+    for (rounds = 0; rounds < n; rounds++)
+    {
+        mag->rounds[rounds] = vmem_xalloc_locked(vmp, qc->size, 0, 0, 0, (void *)VMEM_ADDR_MIN, (void *)VMEM_ADDR_MAX,
+                                                 rounds == 0 ? vmflag : vmflag | VM_NOSLEEP);
+
+        if (mag->rounds[rounds] == NULL)
+            break;
+    }
+
+    vmem_spin_unlock(&vmp->lock);
+
+    return rounds;
+}
+
+/* Gives the `rounds` objects of `mag` back to the arena */
+static void qcache_flush(Vmem *vmp, VmemQCache *qc, VmemMagazine *mag, int rounds)
+{
+    vmem_spin_lock(&vmp->lock);
+
+    while (rounds > 0)
+    {
+        vmem_xfree_locked(vmp, mag->rounds[--rounds], qc->size);
+    }
+
+    vmem_spin_unlock(&vmp->lock);
+}
+
+static void *qcache_alloc(Vmem *vmp, VmemQCache *qc, int vmflag)
+{
+    VmemCpuCache *ccp = &qc->cpu[vmem_cpu_id()];
+    VmemMagazine *mag;
+    int rounds;
+    void *ret;
+
+    vmem_spin_lock(&ccp->lock);
+
+    while (true)
+    {
+        if (ccp->rounds > 0)
+        {
+            ret = ccp->loaded->rounds[--ccp->rounds];
+            vmem_spin_unlock(&ccp->lock);
+            return ret;
+        }
+
+        /* If the loaded magazine is empty but the previous one isn't, exchange them */
+        if (ccp->prounds > 0)
+        {
+            qcache_swap(ccp);
+            continue;
+        }
+
+        /* Both magazines are empty, try to get a full one from the depot */
+        if ((mag = depot_alloc(&qc->depot, true)) == NULL)
+            break;
+
+        if (ccp->previous != NULL)
+            depot_free(&qc->depot, ccp->previous, false);
+
+        ccp->previous = ccp->loaded;
+        ccp->prounds = 0;
+        ccp->loaded = mag;
+        ccp->rounds = VMEM_MAGAZINE_ROUNDS;
+    }
+
+    vmem_spin_unlock(&ccp->lock);
+
+    /* The depot is empty too, reload from the arena. The CPU lock isn't held meanwhile: the magazine may take a page,
+     * and the arena may import from its source. Only half of the magazine is filled so that the following frees still have room. */
+    if ((mag = depot_alloc(&qc->depot, false)) == NULL && (mag = magazine_alloc()) == NULL)
+    {
+        /* No magazine could be allocated, fall back to the arena */
+        return vmem_arena_alloc(vmp, qc->size, 0, 0, 0, (void *)VMEM_ADDR_MIN, (void *)VMEM_ADDR_MAX, vmflag);
+    }
+
+    if ((rounds = qcache_fill(vmp, qc, mag, VMEM_MAGAZINE_ROUNDS / 2, vmflag)) == 0)
+    {
+        depot_free(&qc->depot, mag, false);
+        return NULL;
+    }
+
+    ret = mag->rounds[--rounds];
+
+    vmem_spin_lock(&ccp->lock);
+
+    /* Look at the slot again, another thread sharing it may have loaded objects while the lock was dropped */
+    if (ccp->rounds == 0 && ccp->prounds == 0)
+    {
+        if (ccp->previous == NULL)
+            ccp->previous = ccp->loaded;
+        else if (ccp->loaded != NULL)
+            depot_free(&qc->depot, ccp->loaded, false);
+
+        ccp->loaded = mag;
+        ccp->rounds = rounds;
+        mag = NULL;
+    }
+
+    vmem_spin_unlock(&ccp->lock);
+
+    /* The slot didn't need the new magazine after all */
+    if (mag != NULL)
+    {
+        qcache_flush(vmp, qc, mag, rounds);
+        depot_free(&qc->depot, mag, false);
+    }
+
+    return ret;
+}
+
+static void qcache_free(Vmem *vmp, VmemQCache *qc, void *addr)
+{
+    VmemCpuCache *ccp = &qc->cpu[vmem_cpu_id()];
+    VmemMagazine *mag;
+
+    vmem_spin_lock(&ccp->lock);
+
+    while (true)
+    {
+        if (ccp->loaded != NULL && ccp->rounds < VMEM_MAGAZINE_ROUNDS)
+        {
+            ccp->loaded->rounds[ccp->rounds++] = addr;
+            vmem_spin_unlock(&ccp->lock);
+            return;
+        }
+
+        /* If the loaded magazine is full (or missing) but the previous one isn't, exchange them */
+        if (ccp->previous != NULL && ccp->prounds < VMEM_MAGAZINE_ROUNDS)
+        {
+            qcache_swap(ccp);
+            continue;
+        }
+
+        /* Both magazines are full, put the previous one in the depot and load an empty one */
+        if ((mag = depot_alloc(&qc->depot, false)) != NULL)
+        {
+            if (ccp->previous != NULL)
+                depot_free(&qc->depot, ccp->previous, true);
+
+            ccp->previous = ccp->loaded;
+            ccp->prounds = ccp->rounds;
+            ccp->loaded = mag;
+            ccp->rounds = 0;
+            continue;
+        }
+
+        /* The depot has no empty magazine. A new one may take a page, so it's allocated without the CPU lock
+         * and given to the depot, then the slot is looked at again since it may have changed meanwhile */
+        vmem_spin_unlock(&ccp->lock);
+
+        if ((mag = magazine_alloc()) == NULL)
+        {
+            /* No magazine could be allocated, give the object back to the arena */
+            vmem_arena_free(vmp, addr, qc->size);
+            return;
+        }
+
+        depot_free(&qc->depot, mag, false);
+        vmem_spin_lock(&ccp->lock);
+    }
+}
+
+/* Gives `nfull` full and `nempty` empty magazines of the depot back */
+static void depot_reap(Vmem *vmp, VmemQCache *qc, size_t nfull, size_t nempty)
+{
+    VmemMagazine *mag;
+
+    while (nfull-- > 0 && (mag = depot_alloc(&qc->depot, true)) != NULL)
+    {
+        qcache_flush(vmp, qc, mag, VMEM_MAGAZINE_ROUNDS);
+        magazine_free(mag);
+    }
+
+    while (nempty-- > 0 && (mag = depot_alloc(&qc->depot, false)) != NULL)
+    {
+        magazine_free(mag);
+    }
+}
+
+void vmem_reap(Vmem *vmp)
+{
+    VmemQCache *qc;
+    VmemDepot *depot;
+    size_t nfull, nempty;
+
+    for (qc = vmp->qcache; qc < vmp->qcache + qcache_count(vmp); qc++)
+    {
+        depot = &qc->depot;
+
+        /* Magazines below the working set minimum weren't used since the last reap */
+        vmem_spin_lock(&depot->lock);
+        nfull = depot->fullmin;
+        nempty = depot->emptymin;
+        vmem_spin_unlock(&depot->lock);
+
+        depot_reap(vmp, qc, nfull, nempty);
+
+        /* Start a new interval */
+        vmem_spin_lock(&depot->lock);
+        depot->fullmin = depot->nfull;
+        depot->emptymin = depot->nempty;
+        vmem_spin_unlock(&depot->lock);
+    }
+
+    /* Give back the spans that stayed idle for the whole interval, then start a new one */
+    vmem_spin_lock(&vmp->lock);
+    (void)vmem_free_pending(vmp, VM_NOSLEEP);
+    vmem_release_idle(vmp, vmp->reapgen);
+    vmp->reapgen++;
+    vmem_spin_unlock(&vmp->lock);
+}
+
+/* Gives every cached object and magazine back */
+static void qcache_purge(Vmem *vmp)
+{
+    VmemQCache *qc;
+    VmemCpuCache *ccp;
+    VmemMagazine *loaded, *previous;
+    int rounds, prounds;
+
+    for (qc = vmp->qcache; qc < vmp->qcache + qcache_count(vmp); qc++)
+    {
+        depot_reap(vmp, qc, (size_t)-1, (size_t)-1);
+
+        for (ccp = qc->cpu; ccp < &qc->cpu[VMEM_NCPU]; ccp++)
+        {
+            /* The magazines are unloaded first: flushing them may release spans to the source */
+            vmem_spin_lock(&ccp->lock);
+            loaded = ccp->loaded;
+            previous = ccp->previous;
+            rounds = ccp->rounds;
+            prounds = ccp->prounds;
+            ccp->loaded = ccp->previous = NULL;
+            ccp->rounds = ccp->prounds = 0;
+            vmem_spin_unlock(&ccp->lock);
+
+            if (loaded != NULL)
+            {
+                qcache_flush(vmp, qc, loaded, rounds);
+                magazine_free(loaded);
+            }
+
+            if (previous != NULL)
+            {
+                qcache_flush(vmp, qc, previous, prounds);
+                magazine_free(previous);
+            }
+        }
+    }
+}
+
+int vmem_init(Vmem *ret, char *name, void *base, size_t size, size_t quantum, VmemAlloc *afunc, VmemFree *ffunc, Vmem *source, size_t qcache_max, int vmflag)
+{
+    VmemCpuCache *cpu;
+    size_t i, n;
+
+    strcpy(ret->name, name);
+
+    ret->base = base;
+    ret->size = size;
+    ret->quantum = quantum;
+    ret->alloc = afunc;
+    ret->free = ffunc;
+    ret->source = source;
+    /* There's only VMEM_QCACHES_N quantum caches, anything bigger goes straight to the arena */
+    ret->qcache_max = quantum ? MIN(qcache_max, quantum * VMEM_QCACHES_N) / quantum * quantum : 0;
+    ret->vmflag = vmflag;
+    ret->import_min = 0;
+    ret->import_max = 0;
+    ret->import_next = 0;
+    ret->lock = 0;
+    /* The initial span is accounted for by vmem_add() */
+    memset(&ret->stat, 0, sizeof(ret->stat));
+
+    LIST_INIT(&ret->spanlist);
+    ret->nidle = 0;
+    ret->idlebytes = 0;
+    ret->idle_max = 0;
+    ret->idle_max_bytes = 0;
+    ret->reapgen = 0;
+    memset(&ret->counters, 0, sizeof(ret->counters));
+    ret->timed = false;
+    memset(&ret->hist_alloc, 0, sizeof(ret->hist_alloc));
+    memset(&ret->hist_free, 0, sizeof(ret->hist_free));
+    ret->trace = NULL;
+    ret->tracesize = 0;
+    ret->tracehead = 0;
+    ret->tracepos = 0;
+    ret->tracers = 0;
+
+    for (i = 0; i < VMEM_TAG_CLASSES; i++)
+    {
+        SLIST_INIT(&ret->freesegs[i]);
+        ret->nfreesegs[i] = 0;
+    }
+
+    STAILQ_INIT(&ret->pending);
+
+    TAILQ_INIT(&ret->segqueue);
+
+    /* The rotor starts before every span */
+    memset(&ret->rotor, 0, sizeof(ret->rotor));
+    ret->rotor.type = SEGMENT_ROTOR;
+    TAILQ_INSERT_HEAD(&ret->segqueue, &ret->rotor, segqueue);
+
+    for (i = 0; i < ARR_SIZE(ret->freelist); i++)
+    {
+        LIST_INIT(&ret->freelist[i]);
+    }
+
+    ret->freemap = 0;
+    ret->trees = false;
+    ret->sizetree = NULL;
+    ret->addrtree = NULL;
+
+    for (i = 0; i < ARR_SIZE(ret->hash0); i++)
+    {
+        SLIST_INIT(&ret->hash0[i]);
+    }
+
+    ret->hashtable = ret->hash0;
+    ret->hashsize = HASHTABLES_N;
+    ret->oldhash = NULL;
+    ret->oldhashsize = 0;
+    ret->rehash_pos = 0;
+    ret->nalloc = 0;
+
+    /* Only the caches up to `qcache_max` are allocated, an arena without caches takes no page */
+    ret->qcache = NULL;
+    n = qcache_count(ret);
+
+    if (n > 0 && (ret->qcache = vmem_alloc_pages(qcache_pages(n))) == NULL)
+        return -VMEM_ERR_NO_MEM;
+
+    cpu = n > 0 ? (VmemCpuCache *)((char *)ret->qcache + qcache_cpu_offset(n)) : NULL;
+
+    for (i = 0; i < n; i++)
+    {
+        ret->qcache[i].size = (i + 1) * quantum;
+        memset(&ret->qcache[i].depot, 0, sizeof(ret->qcache[i].depot));
+        LIST_INIT(&ret->qcache[i].depot.full);
+        LIST_INIT(&ret->qcache[i].depot.empty);
+        ret->qcache[i].cpu = &cpu[i * VMEM_NCPU];
+        memset(ret->qcache[i].cpu, 0, VMEM_NCPU * sizeof(*cpu));
+    }
+
+    /* Add initial span */
+    if (!source && size)
+        vmem_add(ret, base, size, vmflag);
+
+    return 0;
+}
+
+void vmem_destroy(Vmem *vmp)
+{
+    VmemSegment *seg;
+    size_t i;
+
+    qcache_purge(vmp);
+
+    if (vmp->qcache != NULL)
+        vmem_free_pages(vmp->qcache, qcache_pages(qcache_count(vmp)));
+
+    vmp->qcache = NULL;
+    ASSERT(vmp->nalloc == 0);
+
+    /* Every segment is free by now, give the imported spans back (idle or not) */
+    TAILQ_FOREACH(seg, &vmp->segqueue, segqueue)
+    {
+        if (seg->type == SEGMENT_SPAN && seg->imported && vmp->free != NULL)
+        {
+            vmp->free(vmp->source, (void *)seg->base, seg->size);
+            vmp->stat.import -= seg->size;
+            vmp->stat.total -= seg->size;
+            vmp->stat.free -= seg->size;
+        }
+    }
+
+    for (i = 0; i < vmp->hashsize; i++)
+        ASSERT(SLIST_EMPTY(&vmp->hashtable[i]));
+
+    /* Pending segments are still in the segment queue, their tags are freed with the others */
+    STAILQ_INIT(&vmp->pending);
+
+    if (vmp->oldhash != NULL && vmp->oldhash != vmp->hash0)
+        vmem_free_pages(vmp->oldhash, hashtab_pages(vmp->oldhashsize));
+
+    if (vmp->hashtable != vmp->hash0)
+        vmem_free_pages(vmp->hashtable, hashtab_pages(vmp->hashsize));
+
+    /* The tags can't be walked in place anymore, freeing them may give their slab back */
+    while ((seg = TAILQ_FIRST(&vmp->segqueue)) != NULL)
+    {
+        TAILQ_REMOVE(&vmp->segqueue, seg, segqueue);
+
+        if (seg != &vmp->rotor)
+            seg_free(seg);
+    }
+
+    for (i = 0; i < VMEM_TAG_CLASSES; i++)
+    {
+        while ((seg = SLIST_FIRST(&vmp->freesegs[i])) != NULL)
+        {
+            SLIST_REMOVE_HEAD(&vmp->freesegs[i], u.link);
+            seg_free(seg);
+        }
+
+        vmp->nfreesegs[i] = 0;
+    }
+}
+
+void *vmem_add(Vmem *vmp, void *addr, size_t size, int vmflag)
+{
+    void *ret;
+
+    vmem_spin_lock(&vmp->lock);
+
+    if (vmem_populate(vmp, vmflag) != 0)
+    {
+        vmem_spin_unlock(&vmp->lock);
+        return NULL;
+    }
+
+    ASSERT(!vmem_contains(vmp, addr, size));
+
+    vmp->stat.free += size;
+    vmp->stat.total += size;
+    ret = vmem_add_internal(vmp, addr, size, false);
+    vmem_trace_event(vmp, VMEM_TRACE_ADD, vmflag, (uintptr_t)addr, size);
+
+    vmem_spin_unlock(&vmp->lock);
+
+    return ret;
+}
+
+/* Must be called with the arena lock held */
+static void *vmem_xalloc_locked(Vmem *vmp, size_t size, size_t align, size_t phase,
+                                size_t nocross, void *minaddr, void *maxaddr, int vmflag)
+{
+    size_t first = GET_LIST(size);
+    uintptr_t map;
+    VmemSegment *new_seg = NULL, *new_seg2 = NULL, *seg = NULL, *span;
+    size_t buckets = 0, rejects = 0, span_size;
+    uintptr_t start = 0;
+    bool constrained;
+    void *ret = NULL;
+
+    /* `nocross` must be a power of two, big enough to hold the allocation */
+    ASSERT(nocross == 0 || ((nocross & (nocross - 1)) == 0 && size <= nocross));
+
+    /* If no policy is specified, the default is VM_INSTANTFIT */
+    if (!(vmflag & (VM_INSTANTFIT | VM_BESTFIT | VM_NEXTFIT)))
+    {
+        vmflag |= VM_INSTANTFIT;
+    }
+
+    /* If we don't want a specific alignment, we can just use the quantum */
+    /* FIXME: What if `align` is not quantum aligned? Maybe add an ASSERT() ? */
+
+    if (align == 0)
+    {
+        align = vmp->quantum;
+    }
+
+    constrained = align > vmp->quantum || phase != 0 || nocross != 0 || (uintptr_t)minaddr != VMEM_ADDR_MIN || (uintptr_t)maxaddr != VMEM_ADDR_MAX;
+
+    /* Frees only move segments around in the hashtable, allocations resize it */
+    hashtab_resize(vmp);
+
+    while (true)
+    {
+        /* Make sure splitting the segment we find can't fail. The reserve is usually full already,
+         * so the tags are only taken from it below, when a split actually happens. */
+        if (vmem_free_pending(vmp, vmflag) != 0 || vmem_populate(vmp, vmflag) != 0)
+        {
+            ASSERT((vmflag & VM_NOSLEEP) && "Allocation failed");
+            return NULL;
+        }
+
+        if (vmflag & VM_INSTANTFIT) /* VM_INSTANTFIT */
+        {
+            /* If the size is not a power of two, use freelist[n+1] instead of freelist[n] */
+            map = vmp->freemap;
+
+            if ((size & (size - 1)) != 0)
+                map = first + 1 < FREELISTS_N ? map & (~(uintptr_t)0 << (first + 1)) : 0;
+            else
+                map &= ~(uintptr_t)0 << first;
+
+            /* We just get the first segment from the first non-empty list, found with the bitmap. This ensures constant-time allocation.
+             * Note that we do not need to check the size of the segments because they are guaranteed to be big enough (see vmem_add_to_freelist)
+             */
+            for (; map != 0; map &= map - 1)
+            {
+                seg = vmem_freelist_head(vmp, __builtin_ctzl(map));
+                ASSERT(seg != NULL);
+                buckets++;
+
+                if (seg_fit(seg, size, align, phase, nocross, (uintptr_t)minaddr, (uintptr_t)maxaddr, &start) == 0)
+                    goto found;
+
+                rejects++;
+            }
+
+            /* The list heads couldn't be used: the allocation is constrained, or the only segments that are big enough
+             * are in freelist[n] (which we skip when the size isn't a power of two). */
+            VMEM_COUNT(vmp, instant_slow, 1);
+
+            /* An unconstrained allocation imports right away, like the freelists alone would, so that it stays constant time.
+             * Otherwise, before importing, make sure there's really no free segment that fits by searching the address tree. */
+            if (!vmp->trees && !constrained)
+                goto import;
+
+            if (!vmp->trees)
+                vmem_build_trees(vmp);
+
+            /* Any segment of at least `size + align - quantum` bytes has an aligned address, so look for those first:
+             * the search then skips the smaller segments that would only be rejected for their alignment.
+             * Smaller segments can still fit if they happen to be aligned, they're only searched if there's no bigger one. */
+            seg = NULL;
+
+            if (align > vmp->quantum && size <= (size_t)-1 - align)
+                seg = addrtree_fit(vmp->addrtree, size + align - vmp->quantum, size, align, phase, nocross, (uintptr_t)minaddr, (uintptr_t)maxaddr, &start, &rejects);
+
+            if (seg == NULL)
+                seg = addrtree_fit(vmp->addrtree, size, size, align, phase, nocross, (uintptr_t)minaddr, (uintptr_t)maxaddr, &start, &rejects);
+
+            if (seg != NULL)
+                goto found;
+        }
+
+        else if (vmflag & VM_BESTFIT) /* VM_BESTFIT */
+        {
+            /* The size tree gives us the smallest free segment that can satisfy the allocation in O(log n).
+             * If the constraints make it unusable, we try the next smallest one. */
+            if (!vmp->trees)
+                vmem_build_trees(vmp);
+
+            for (seg = sizetree_ceil(vmp->sizetree, size, 0); seg != NULL; seg = sizetree_ceil(vmp->sizetree, seg->size, seg->base + 1))
+            {
+                if (seg_fit(seg, size, align, phase, nocross, (uintptr_t)minaddr, (uintptr_t)maxaddr, &start) == 0)
+                    goto found;
+
+                rejects++;
+            }
+        }
+        else if (vmflag & VM_NEXTFIT)
+        {
+            /* Walk the arena starting from the rotor, wrapping around at the end, until we find a free segment that fits.
+             * Since the rotor is left after the previous allocation, the next free segment is usually right after it. */
+            seg = &vmp->rotor;
+
+            while (true)
+            {
+                seg = TAILQ_NEXT(seg, segqueue);
+
+                if (seg == NULL)
+                    seg = TAILQ_FIRST(&vmp->segqueue);
+
+                if (seg == &vmp->rotor)
+                    break;
+
+                if (seg->type != SEGMENT_FREE || seg->size < size)
+                    continue;
+
+                if (seg_fit(seg, size, align, phase, nocross, (uintptr_t)minaddr, (uintptr_t)maxaddr, &start) == 0)
+                    goto found;
+
+                rejects++;
+            }
+        }
+
+    import:
+        VMEM_COUNT(vmp, misses, 1);
+
+        /* Import a span big enough for the allocation wherever it starts: an aligned address is at most `align - quantum` bytes in,
+         * and a segment that would cross a `nocross` boundary fits right after it, at most `size - quantum` bytes further */
+        span_size = size;
+        span_size += align > vmp->quantum && span_size <= (size_t)-1 - align ? align - vmp->quantum : 0;
+        span_size += nocross != 0 && span_size <= (size_t)-1 - size ? size - vmp->quantum : 0;
+
+        if (vmem_import(vmp, span_size, vmflag, &seg) == 0)
+        {
+            if (seg_fit(seg, size, align, phase, nocross, (uintptr_t)minaddr, (uintptr_t)maxaddr, &start) == 0)
+                goto found;
+
+            /* The source can't be asked for an address range, so the span was imported anywhere: another import wouldn't
+             * do better. Give the span back right away instead of stranding it. */
+            vmem_remove_from_freelist(vmp, seg);
+            vmem_release_span(vmp, seg);
+        }
+
+        /* Rather than failing, an unconstrained instant fit without trees searches the freelist it skipped */
+        if ((vmflag & VM_INSTANTFIT) && !vmp->trees && !constrained)
+        {
+            LIST_FOREACH(seg, &vmp->freelist[first], f.seglist)
+            {
+                if (seg->size >= size && seg_fit(seg, size, align, phase, nocross, (uintptr_t)minaddr, (uintptr_t)maxaddr, &start) == 0)
+                    goto found;
             }
         }
 
-        else if (vmflag & VM_BESTFIT) /* VM_BESTFIT */
-        {
-            /* TODO: Should we bother going through the entire list to find the absolute best fit? */
+        VMEM_COUNT(vmp, buckets, buckets);
+        VMEM_COUNT(vmp, fit_rejects, rejects);
+        ASSERT((vmflag & VM_NOSLEEP) && "Allocation failed");
+        return NULL;
+    }
+
+found:
+    ASSERT(seg != NULL);
+
+    /* Counted once per allocation, the search loops stay tight */
+    if (buckets != 0 || rejects != 0)
+    {
+        VMEM_COUNT(vmp, buckets, buckets);
+        VMEM_COUNT(vmp, fit_rejects, rejects);
+    }
+
+    ASSERT(seg->type == SEGMENT_FREE);
+    ASSERT(seg->size >= size);
+
+    /* Remove the segment from the freelist, it may be added back when modified */
+    vmem_remove_from_freelist(vmp, seg);
+
+    /* If this is an idle span, it's not idle anymore */
+    span = TAILQ_PREV(seg, VmemSegQueue, segqueue);
+
+    if (span->type == SEGMENT_SPAN && span->idle)
+        vmem_span_busy(vmp, span);
+
+    if (seg->base != start)
+    {
+        /* If the start is not the base of the segment, we need to create another segment;
+         * new_seg2 is a free segment that starts at `base` and ends at `start-base`.
+         * We also need to make make `seg` start at `start` and reduce its size.
+         * For example, if we allocate a segment [0x100, 0x1000] in a [0, 0x10000] span, we need to split [0, 0x10000] into
+         * [0x0, 0x100] (free), [0x100, 0x1000] (allocated), [0x1000, 0x10000] (free). In this case, `base` is 0 and `start` is 0x100.
+         * This would create a segment with size 0x100-0 that starts at 0.
+         */
+        new_seg2 = vmem_seg_get(vmp, VMEM_TAG_FULL);
+        new_seg2->type = SEGMENT_FREE;
+        new_seg2->imported = false;
+        new_seg2->base = seg->base;
+        new_seg2->size = start - seg->base;
+
+        /* Make `seg` start at `start`, following the example, this would make `(seg->base)` 0x100 */
+        seg->base = start;
+
+        /* Since we offset the segment by `start-(seg->base)`, we need to reduce `seg`'s size */
+        seg->size -= new_seg2->size;
+
+        vmem_add_to_freelist(vmp, new_seg2);
+
+        /* Put this new segment before the allocated segment */
+        vmem_insert_segment(vmp, new_seg2, TAILQ_PREV(seg, VmemSegQueue, segqueue));
+    }
+
+    ASSERT(seg->base == start);
+
+    /* Allocated segments get a compact tag: either a new one for the allocated part, or one that replaces `seg` */
+    new_seg = vmem_seg_get(vmp, VMEM_TAG_SMALL);
+    new_seg->type = SEGMENT_ALLOCATED;
+    new_seg->imported = false;
+    new_seg->base = seg->base;
+
+    if (seg->size != size && (seg->size - size) > vmp->quantum - 1)
+    {
+
+        /* In the case where the segment's size is bigger than the requested size, we need to split the segment into two:
+         * one free part of size `seg->size - size` and another allocated one of size `size`. For example, if we want to allocate [0, 0x1000]
+         * and the segment is [0, 0x10000], we have to create a new segment, [0, 0x1000] and offset the current segment by `size`. Therefore ending up with:
+         *  [0, 0x1000] (allocated) [0x1000, 0x10000] */
+        new_seg->size = size;
+
+        /* Offset the segment */
+        seg->base += size;
+        seg->size -= size;
+
+        /* Add it back to the freelist */
+        vmem_add_to_freelist(vmp, seg);
+
+        /* Put this new allocated segment before the segment */
+        vmem_insert_segment(vmp, new_seg, TAILQ_PREV(seg, VmemSegQueue, segqueue));
+    }
+    else
+    {
+        /* The whole segment is allocated, replace its tag */
+        new_seg->size = seg->size;
+        vmem_insert_segment(vmp, new_seg, seg);
+        TAILQ_REMOVE(&vmp->segqueue, seg, segqueue);
+        vmem_seg_put(vmp, seg);
+    }
+
+    hashtab_insert(vmp, new_seg);
+
+    ASSERT(new_seg->size >= size);
+
+    vmp->stat.free -= new_seg->size;
+    vmp->stat.in_use += new_seg->size;
+    vmp->stat.alloc++;
+
+    /* The next allocation will start looking right after this one */
+    if (vmflag & VM_NEXTFIT)
+        vmem_advance(vmp, new_seg);
+
+    ret = (void *)new_seg->base;
+
+    return ret;
+}
+
+/* Records a vmem_xalloc() and its constraints, only the ones that aren't the defaults */
+static void vmem_trace_xalloc(Vmem *vmp, size_t size, size_t align, size_t phase, size_t nocross,
+                              void *minaddr, void *maxaddr, int vmflag, void *ret)
+{
+    VmemTraceEvent evs[4];
+    size_t n = 0;
+
+    memset(evs, 0, sizeof(evs));
+
+    if (align != 0 || phase != 0)
+    {
+        evs[n].type = VMEM_TRACE_ALIGN;
+        evs[n].addr = align;
+        evs[n++].size = phase;
+    }
+
+    if (nocross != 0)
+    {
+        evs[n].type = VMEM_TRACE_NOCROSS;
+        evs[n++].size = nocross;
+    }
+
+    if ((uintptr_t)minaddr != VMEM_ADDR_MIN || (uintptr_t)maxaddr != VMEM_ADDR_MAX)
+    {
+        evs[n].type = VMEM_TRACE_RANGE;
+        evs[n].addr = (uintptr_t)minaddr;
+        evs[n++].size = (uintptr_t)maxaddr;
+    }
+
+    evs[n].type = VMEM_TRACE_XALLOC;
+    evs[n].vmflag = vmflag;
+    evs[n].addr = (uintptr_t)ret;
+    evs[n++].size = size;
+
+    vmem_trace(vmp, evs, n);
+}
+
+void *vmem_xalloc(Vmem *vmp, size_t size, size_t align, size_t phase,
+                  size_t nocross, void *minaddr, void *maxaddr, int vmflag)
+{
+    void *ret;
+
+    ret = vmem_arena_alloc(vmp, size, align, phase, nocross, minaddr, maxaddr, vmflag);
+
+    if (VMEM_TRACING(vmp))
+        vmem_trace_xalloc(vmp, size, align, phase, nocross, minaddr, maxaddr, vmflag, ret);
+
+    return ret;
+}
+
+void *vmem_alloc(Vmem *vmp, size_t size, int vmflag)
+{
+    void *ret;
+
+    /* Small allocations are served by the quantum caches */
+    if (size > 0 && size <= vmp->qcache_max)
+    {
+        ret = qcache_alloc(vmp, qcache_for_size(vmp, size), vmflag);
+    }
+    else
+    {
+        ret = vmem_arena_alloc(vmp, size, 0, 0, 0, (void *)VMEM_ADDR_MIN, (void *)VMEM_ADDR_MAX, vmflag);
+    }
+
+    vmem_trace_event(vmp, VMEM_TRACE_ALLOC, vmflag, (uintptr_t)ret, size);
+
+    return ret;
+}
+
+/* Puts the allocated or pending segment `seg`, which is in no list, in the freelists. Must be called with the arena lock held
+ * and a full-size tag in the reserve. The lock is dropped if that frees a whole imported span that's given back. */
+static void vmem_free_segment(Vmem *vmp, VmemSegment *seg)
+{
+    VmemSegment *neighbor, *free_seg;
+
+    /* The compact tag of the allocated segment can't be put in the freelists.
+     * Extend a free neighbor over it if there is one, else replace it with a full-size tag. */
+    free_seg = TAILQ_PREV(seg, VmemSegQueue, segqueue);
+    neighbor = TAILQ_NEXT(seg, segqueue);
+
+    if (free_seg->type == SEGMENT_FREE)
+    {
+        vmem_remove_from_freelist(vmp, free_seg);
+        free_seg->size += seg->size;
+        VMEM_COUNT(vmp, coalesce_left, 1);
+    }
+    else if (neighbor && neighbor->type == SEGMENT_FREE)
+    {
+        free_seg = neighbor;
+        vmem_remove_from_freelist(vmp, free_seg);
+        free_seg->base = seg->base;
+        free_seg->size += seg->size;
+        VMEM_COUNT(vmp, coalesce_right, 1);
+    }
+    else
+    {
+        free_seg = vmem_seg_get(vmp, VMEM_TAG_FULL);
+        free_seg->type = SEGMENT_FREE;
+        free_seg->imported = false;
+        free_seg->base = seg->base;
+        free_seg->size = seg->size;
+        vmem_insert_segment(vmp, free_seg, seg);
+    }
+
+    TAILQ_REMOVE(&vmp->segqueue, seg, segqueue);
+    vmem_seg_put(vmp, seg);
+
+    /* Coalesce to the right */
+    neighbor = TAILQ_NEXT(free_seg, segqueue);
+
+    if (neighbor && neighbor->type == SEGMENT_FREE)
+    {
+        /* Remove our neighbor since we're merging with it */
+        vmem_remove_from_freelist(vmp, neighbor);
+
+        TAILQ_REMOVE(&vmp->segqueue, neighbor, segqueue);
+
+        free_seg->size += neighbor->size;
+
+        vmem_seg_put(vmp, neighbor);
+        VMEM_COUNT(vmp, coalesce_right, 1);
+    }
+
+    neighbor = TAILQ_PREV(free_seg, VmemSegQueue, segqueue);
+
+    ASSERT(neighbor->type != SEGMENT_FREE);
+
+    if (vmem_span_is_free(vmp, free_seg))
+        vmem_span_freed(vmp, free_seg);
+    else
+        vmem_add_to_freelist(vmp, free_seg);
+}
+
+/* Puts the pending segments in the freelists, refilling the tag reserve as needed.
+ * Must be called with the arena lock held, the lock may be dropped. */
+static int vmem_free_pending(Vmem *vmp, int vmflag)
+{
+    VmemSegment *seg;
+
+    while (!STAILQ_EMPTY(&vmp->pending))
+    {
+        if (vmem_populate(vmp, vmflag) != 0)
+            return -VMEM_ERR_NO_MEM;
+
+        /* Another thread may have emptied the list while the lock was dropped */
+        if ((seg = STAILQ_FIRST(&vmp->pending)) == NULL)
+            break;
+
+        STAILQ_REMOVE_HEAD(&vmp->pending, u.queue);
+        vmem_free_segment(vmp, seg);
+    }
+
+    return 0;
+}
+
+/* Must be called with the arena lock held */
+static void vmem_xfree_locked(Vmem *vmp, void *addr, size_t size)
+{
+    VmemSegment *seg, *prev, *next;
+
+    /* Remove the segment from the hashtable */
+    seg = hashtab_remove(vmp, (uintptr_t)addr);
+
+    ASSERT(seg != NULL && seg->size == size);
+
+    vmp->stat.in_use -= size;
+    vmp->stat.free += size;
+    vmp->stat.frees++;
+
+    prev = TAILQ_PREV(seg, VmemSegQueue, segqueue);
+    next = TAILQ_NEXT(seg, segqueue);
+
+    /* Without a free neighbor, the segment needs a full-size tag. So that a free can't fail, it never allocates one:
+     * if the reserve is empty, the segment waits for the next allocation, which can */
+    if (prev->type == SEGMENT_FREE || (next != NULL && next->type == SEGMENT_FREE) || !SLIST_EMPTY(&vmp->freesegs[VMEM_TAG_FULL]))
+    {
+        vmem_free_segment(vmp, seg);
+        return;
+    }
+
+    /* Pending neighbors are extended over the segment, so that a run of frees only waits for one tag */
+    if (prev->type == SEGMENT_PENDING)
+    {
+        prev->size += seg->size;
+    }
+    else if (next != NULL && next->type == SEGMENT_PENDING)
+    {
+        next->base = seg->base;
+        next->size += seg->size;
+    }
+    else
+    {
+        seg->type = SEGMENT_PENDING;
+        STAILQ_INSERT_TAIL(&vmp->pending, seg, u.queue);
+        return;
+    }
+
+    TAILQ_REMOVE(&vmp->segqueue, seg, segqueue);
+    vmem_seg_put(vmp, seg);
+}
+
+void vmem_set_import(Vmem *vmp, size_t min, size_t max)
+{
+    vmem_spin_lock(&vmp->lock);
+    vmp->import_min = min;
+    vmp->import_max = MAX(min, max);
+    vmp->import_next = min;
+    vmem_spin_unlock(&vmp->lock);
+}
+
+void vmem_set_retain(Vmem *vmp, size_t nspans, size_t bytes)
+{
+    vmem_spin_lock(&vmp->lock);
+    vmp->idle_max = nspans;
+    vmp->idle_max_bytes = bytes;
+
+    /* If the idle spans don't fit anymore, give them all back */
+    if (vmp->nidle > nspans || vmp->idlebytes > bytes)
+        vmem_release_idle(vmp, ~0UL);
+
+    vmem_spin_unlock(&vmp->lock);
+}
+
+void vmem_xfree(Vmem *vmp, void *addr, size_t size)
+{
+    vmem_trace_event(vmp, VMEM_TRACE_XFREE, 0, (uintptr_t)addr, size);
+
+    vmem_arena_free(vmp, addr, size);
+}
+
+void vmem_free(Vmem *vmp, void *addr, size_t size)
+{
+    vmem_trace_event(vmp, VMEM_TRACE_FREE, 0, (uintptr_t)addr, size);
+
+    if (size > 0 && size <= vmp->qcache_max)
+    {
+        qcache_free(vmp, qcache_for_size(vmp, size), addr);
+        return;
+    }
+
+    vmem_arena_free(vmp, addr, size);
+}
+
+int vmem_trace_start(Vmem *vmp, VmemTraceEvent *buf, size_t n)
+{
+    VmemSegment *seg;
+    size_t head = vmp->alloc != NULL ? 2 : 1, quantum;
+
+    vmem_spin_lock(&vmp->lock);
+
+    TAILQ_FOREACH(seg, &vmp->segqueue, segqueue)
+    {
+        if (seg->type == SEGMENT_SPAN)
+            head++;
+    }
+
+    /* The head describes the arena, at least one more event is needed for the ring */
+    if (vmp->trace != NULL || n <= head)
+    {
+        vmem_spin_unlock(&vmp->lock);
+        return -VMEM_ERR_NO_MEM;
+    }
 
-            /* We go through every segment in every list until we find the smallest free segment that can satisfy the allocation */
-            for (list = first_list; list < end; list++)
-                LIST_FOREACH(seg, list, seglist)
-                {
-                    if (seg->size >= size)
-                    {
+    buf[0].type = VMEM_TRACE_ARENA;
+    buf[0].vmflag = vmp->vmflag;
+    buf[0].addr = vmp->quantum;
+    buf[0].size = vmp->qcache_max;
+    head = 1;
 
-                        /* Try to make the segment fit */
-                        if (seg_fit(seg, size, align, phase, nocross, (uintptr_t)minaddr, (uintptr_t)maxaddr, &start) == 0)
-                            goto found;
-                    }
-                }
-        }
-        else if (vmflag & VM_NEXTFIT)
-        {
-            ASSERT(!"TODO: implement nextfit");
-        }
+    if (vmp->alloc != NULL)
+    {
+        quantum = vmp->source != NULL ? vmp->source->quantum : vmp->quantum;
+        buf[head].type = VMEM_TRACE_SOURCE;
+        buf[head].vmflag = __builtin_ctzl(quantum);
+        buf[head].addr = vmp->import_min;
+        buf[head].size = vmp->import_max;
+        head++;
+    }
 
-        if (vmem_import(vmp, size, vmflag) == 0)
-        {
+    TAILQ_FOREACH(seg, &vmp->segqueue, segqueue)
+    {
+        if (seg->type != SEGMENT_SPAN)
             continue;
-        }
 
-        ASSERT(!"Allocation failed");
-        return NULL;
+        buf[head].type = seg->imported ? VMEM_TRACE_IMPORT : VMEM_TRACE_ADD;
+        buf[head].vmflag = 0;
+        buf[head].addr = seg->base;
+        buf[head].size = seg->size;
+        head++;
     }
 
-found:
-    ASSERT(seg != NULL);
-    ASSERT(seg->type == SEGMENT_FREE);
-    ASSERT(seg->size >= size);
-
-    /* Remove the segment from the freelist, it may be added back when modified */
-    LIST_REMOVE(seg, seglist);
+    vmp->tracesize = n;
+    vmp->tracehead = head;
+    vmp->tracepos = 0;
 
-    if (seg->base != start)
-    {
-        /* If the start is not the base of the segment, we need to create another segment;
-         * new_seg2 is a free segment that starts at `base` and ends at `start-base`.
-         * We also need to make make `seg` start at `start` and reduce its size.
-         * For example, if we allocate a segment [0x100, 0x1000] in a [0, 0x10000] span, we need to split [0, 0x10000] into
-         * [0x0, 0x100] (free), [0x100, 0x1000] (allocated), [0x1000, 0x10000] (free). In this case, `base` is 0 and `start` is 0x100.
-         * This would create a segment with size 0x100-0 that starts at 0.
-         */
-        new_seg2->type = SEGMENT_FREE;
-        new_seg2->base = seg->base;
-        new_seg2->size = start - seg->base;
+    /* Only publish the buffer once it's set up, the quantum caches don't take the lock */
+    __atomic_store_n(&vmp->trace, buf, __ATOMIC_RELEASE);
 
-        /* Make `seg` start at `start`, following the example, this would make `(seg->base)` 0x100 */
-        seg->base = start;
+    vmem_spin_unlock(&vmp->lock);
 
-        /* Since we offset the segment by `start-(seg->base)`, we need to reduce `seg`'s size */
-        seg->size -= new_seg2->size;
+    return 0;
+}
 
-        vmem_add_to_freelist(vmp, new_seg2);
+size_t vmem_trace_stop(Vmem *vmp)
+{
+    VmemTraceEvent *ring;
+    size_t n, pos;
 
-        /* Put this new segment before the allocated segment */
-        vmem_insert_segment(vmp, new_seg2, TAILQ_PREV(seg, VmemSegQueue, segqueue));
+    vmem_spin_lock(&vmp->lock);
 
-        /* Ensure it doesn't get freed */
-        new_seg2 = NULL;
+    if (vmp->trace == NULL)
+    {
+        vmem_spin_unlock(&vmp->lock);
+        return 0;
     }
 
-    ASSERT(seg->base == start);
+    ring = vmp->trace + vmp->tracehead;
+    n = vmp->tracesize - vmp->tracehead;
+    __atomic_store_n(&vmp->trace, NULL, __ATOMIC_SEQ_CST);
 
-    if (seg->size != size && (seg->size - size) > vmp->quantum - 1)
-    {
+    /* The quantum caches record their events without the arena lock, wait for the ones that still saw the buffer */
+    while (__atomic_load_n(&vmp->tracers, __ATOMIC_SEQ_CST) != 0)
+        ;
 
-        /* In the case where the segment's size is bigger than the requested size, we need to split the segment into two:
-         * one free part of size `seg->size - size` and another allocated one of size `size`. For example, if we want to allocate [0, 0x1000]
-         * and the segment is [0, 0x10000], we have to create a new segment, [0, 0x1000] and offset the current segment by `size`. Therefore ending up with:
-         *  [0, 0x1000] (allocated) [0x1000, 0x10000] */
-        new_seg->type = SEGMENT_ALLOCATED;
-        new_seg->base = seg->base;
-        new_seg->size = size;
+    pos = vmp->tracepos;
 
-        /* Offset the segment */
-        seg->base += size;
-        seg->size -= size;
+    /* If the ring wrapped, the oldest event is at `pos % n`: rotate it to the start */
+    if (pos > n)
+    {
+        vmem_trace_reverse(ring, pos % n);
+        vmem_trace_reverse(ring + pos % n, n - pos % n);
+        vmem_trace_reverse(ring, n);
+    }
 
-        /* Add it back to the freelist */
-        vmem_add_to_freelist(vmp, seg);
+    vmem_spin_unlock(&vmp->lock);
 
-        /* Put this new allocated segment before the segment */
-        vmem_insert_segment(vmp, new_seg, TAILQ_PREV(seg, VmemSegQueue, segqueue));
+    return vmp->tracehead + MIN(pos, n);
+}
 
-        hashtab_insert(vmp, new_seg);
-    }
+/* Reports the first inconsistency found by vmem_verify() */
+static int vmem_verify_failed(Vmem *vmp, const char *what, VmemSegment *seg)
+{
+    if (seg != NULL)
+        vmem_printf("vmem_verify: %s: %s: [%p, %p)\n", vmp->name, what, (void *)seg->base, (void *)(seg->base + seg->size));
     else
-    {
-        seg->type = SEGMENT_ALLOCATED;
-        hashtab_insert(vmp, seg);
-        seg_free(new_seg);
-        new_seg = seg;
-    }
+        vmem_printf("vmem_verify: %s: %s\n", vmp->name, what);
 
-    if (new_seg2 != NULL)
-        seg_free(new_seg2);
+    return -VMEM_ERR_CORRUPT;
+}
 
-    ASSERT(new_seg->size >= size);
+#define VMEM_VERIFY(cond, what, seg)                         \
+    do                                                       \
+    {                                                        \
+        if (!(cond))                                         \
+            return vmem_verify_failed(vmp, (what), (seg));   \
+    } while (0)
 
-    vmp->stat.free -= new_seg->size;
-    vmp->stat.in_use += new_seg->size;
+/* Checks the subtree `root` of the size tree. `*prev` is the previous segment in order and `*n` counts the nodes,
+ * which must not exceed the number of free segments (a cycle would recurse forever otherwise). */
+static int sizetree_verify(Vmem *vmp, VmemSegment *root, VmemSegment **prev, size_t *n)
+{
+    int err;
 
-    new_seg->type = SEGMENT_ALLOCATED;
+    if (root == NULL)
+        return 0;
 
-    ret = (void *)new_seg->base;
+    VMEM_VERIFY(++*n <= vmp->stat.freesegs, "size tree has more nodes than free segments", root);
+    VMEM_VERIFY(root->type == SEGMENT_FREE, "segment in the size tree isn't free", root);
+    VMEM_VERIFY(root->f.tree.sleft == NULL || TREE_PRIO(root->f.tree.sleft) <= TREE_PRIO(root), "size tree isn't heap ordered", root);
+    VMEM_VERIFY(root->f.tree.sright == NULL || TREE_PRIO(root->f.tree.sright) <= TREE_PRIO(root), "size tree isn't heap ordered", root);
 
-    return ret;
+    if ((err = sizetree_verify(vmp, root->f.tree.sleft, prev, n)) != 0)
+        return err;
+
+    VMEM_VERIFY(*prev == NULL || sizetree_cmp(*prev, root) < 0, "size tree isn't ordered", root);
+    *prev = root;
+
+    return sizetree_verify(vmp, root->f.tree.sright, prev, n);
 }
 
-void *vmem_alloc(Vmem *vmp, size_t size, int vmflag)
+/* Same as sizetree_verify(), also checks the biggest segment of each subtree */
+static int addrtree_verify(Vmem *vmp, VmemSegment *root, VmemSegment **prev, size_t *n)
 {
-    return vmem_xalloc(vmp, size, 0, 0, 0, (void *)VMEM_ADDR_MIN, (void *)VMEM_ADDR_MAX, vmflag);
+    uintptr_t amax;
+    int err;
+
+    if (root == NULL)
+        return 0;
+
+    VMEM_VERIFY(++*n <= vmp->stat.freesegs, "address tree has more nodes than free segments", root);
+    VMEM_VERIFY(root->type == SEGMENT_FREE, "segment in the address tree isn't free", root);
+    VMEM_VERIFY(root->f.tree.aleft == NULL || TREE_PRIO(root->f.tree.aleft) <= TREE_PRIO(root), "address tree isn't heap ordered", root);
+    VMEM_VERIFY(root->f.tree.aright == NULL || TREE_PRIO(root->f.tree.aright) <= TREE_PRIO(root), "address tree isn't heap ordered", root);
+
+    amax = root->size;
+    amax = root->f.tree.aleft != NULL ? MAX(amax, root->f.tree.aleft->u.amax) : amax;
+    amax = root->f.tree.aright != NULL ? MAX(amax, root->f.tree.aright->u.amax) : amax;
+    VMEM_VERIFY(root->u.amax == amax, "wrong biggest segment size in the address tree", root);
+
+    if ((err = addrtree_verify(vmp, root->f.tree.aleft, prev, n)) != 0)
+        return err;
+
+    VMEM_VERIFY(*prev == NULL || (*prev)->base + (*prev)->size <= root->base, "address tree isn't ordered", root);
+    *prev = root;
+
+    return addrtree_verify(vmp, root->f.tree.aright, prev, n);
 }
 
-void vmem_xfree(Vmem *vmp, void *addr, size_t size)
+/* Checks the span that ends with `last`, whose segments ended at `end` */
+static int vmem_verify_span(Vmem *vmp, VmemSegment *span, VmemSegment *last, uintptr_t end)
 {
-    VmemSegment *seg, *neighbor;
-    VmemSegList *list;
+    if (span == NULL)
+        return 0;
+
+    VMEM_VERIFY(end == span->base + span->size, "segments don't cover their whole span", span);
+
+    /* An idle span is entirely free, but isn't given back */
+    VMEM_VERIFY(!span->idle || (last != NULL && last->type == SEGMENT_FREE && last->size == span->size), "idle span is in use", span);
+
+    return 0;
+}
 
-    list = hashtable_for_addr(vmp, (uintptr_t)addr);
+static void vmem_verify_sift(VmemSegment **spans, size_t i, size_t n)
+{
+    VmemSegment *tmp;
+    size_t child;
 
-    LIST_FOREACH(seg, list, seglist)
+    while ((child = 2 * i + 1) < n)
     {
-        if (seg->base == (uintptr_t)addr)
-        {
+        if (child + 1 < n && spans[child + 1]->base > spans[child]->base)
+            child++;
+
+        if (spans[i]->base >= spans[child]->base)
             break;
-        }
+
+        tmp = spans[i];
+        spans[i] = spans[child];
+        spans[child] = tmp;
+        i = child;
     }
+}
 
-    ASSERT(seg->size == size);
+/* Spans are added in any order: sort the `nspans` spans collected by the segment walk by address (heapsort, in place)
+ * to check that they don't overlap. This is the only part of vmem_verify() that isn't linear. */
+static int vmem_verify_spans(Vmem *vmp, VmemSegment **spans, size_t nspans)
+{
+    VmemSegment *tmp;
+    size_t i;
 
-    /* Remove the segment from the hashtable */
-    LIST_REMOVE(seg, seglist);
+    for (i = nspans / 2; i-- > 0;)
+        vmem_verify_sift(spans, i, nspans);
 
-    /* Coalesce to the right */
-    neighbor = TAILQ_NEXT(seg, segqueue);
+    for (i = nspans; i-- > 1;)
+    {
+        tmp = spans[0];
+        spans[0] = spans[i];
+        spans[i] = tmp;
+        vmem_verify_sift(spans, 0, i);
+    }
 
-    if (neighbor && neighbor->type == SEGMENT_FREE)
+    for (i = 1; i < nspans; i++)
     {
-        /* Remove our neighbor since we're merging with it */
-        LIST_REMOVE(neighbor, seglist);
+        VMEM_VERIFY(spans[i - 1]->base + spans[i - 1]->size <= spans[i]->base, "spans overlap", spans[i]);
+    }
 
-        TAILQ_REMOVE(&vmp->segqueue, neighbor, segqueue);
+    return 0;
+}
 
-        seg->size += neighbor->size;
+/* Returns true if the allocated segment `seg` is in the hashtable */
+static bool hashtab_contains(Vmem *vmp, VmemSegment *seg)
+{
+    VmemSegment *entry;
 
-        seg_free(neighbor);
+    SLIST_FOREACH(entry, hashtable_for_addr(vmp, seg->base), u.link)
+    {
+        if (entry == seg)
+            return true;
     }
 
-    /* Coalesce to the left */
-    neighbor = TAILQ_PREV(seg, VmemSegQueue, segqueue);
+    return false;
+}
+
+/* `spans` has room for `maxspans` spans, to sort them. Must be called with the arena lock held. */
+static int vmem_verify_locked(Vmem *vmp, VmemSegment **spans, size_t maxspans)
+{
+    VmemSegment *seg, *span = NULL, *prev = NULL;
+    size_t in_use = 0, free = 0, total = 0, import = 0, nfree = 0, nalloc = 0, npending = 0, nspans = 0, nidle = 0, idlebytes = 0;
+    size_t i, n, counts[FREELISTS_N], bytes[FREELISTS_N];
+    bool rotor = false; /* The rotor is between `prev` and `seg`, and may keep them from coalescing */
+    uintptr_t end = 0;
+    int err;
+
+    memset(counts, 0, sizeof(counts));
+    memset(bytes, 0, sizeof(bytes));
 
-    if (neighbor->type == SEGMENT_FREE)
+    TAILQ_FOREACH(seg, &vmp->segqueue, segqueue)
     {
-        LIST_REMOVE(neighbor, seglist);
-        TAILQ_REMOVE(&vmp->segqueue, neighbor, segqueue);
+        if (seg == &vmp->rotor)
+        {
+            rotor = true;
+            continue;
+        }
 
-        seg->size += neighbor->size;
-        seg->base = neighbor->base;
+        if (seg->type == SEGMENT_SPAN)
+        {
+            if ((err = vmem_verify_span(vmp, span, prev, end)) != 0)
+                return err;
+
+            VMEM_VERIFY(seg->size > 0 && seg->base + seg->size - 1 >= seg->base, "span is empty or wraps around", seg);
+            VMEM_VERIFY(seg_class(seg) == VMEM_TAG_FULL, "span has a compact tag", seg);
+
+            span = seg;
+            end = seg->base;
+            prev = NULL;
+            rotor = false;
+
+            if (nspans < maxspans)
+                spans[nspans] = seg;
+
+            nspans++;
+            total += seg->size;
+            import += seg->imported ? seg->size : 0;
+            nidle += seg->idle != 0;
+            idlebytes += seg->idle ? seg->size : 0;
+            continue;
+        }
+
+        VMEM_VERIFY(span != NULL, "segment outside of any span", seg);
+        VMEM_VERIFY(seg->base == end, "segment doesn't start where the previous one ends", seg);
+        VMEM_VERIFY(seg->size > 0 && seg->size <= span->base + span->size - seg->base, "segment is empty or exceeds its span", seg);
+        end = seg->base + seg->size;
 
-        seg_free(neighbor);
+        if (seg->type == SEGMENT_FREE)
+        {
+            VMEM_VERIFY(seg_class(seg) == VMEM_TAG_FULL, "free segment has a compact tag", seg);
+            VMEM_VERIFY(prev == NULL || prev->type != SEGMENT_FREE || rotor, "adjacent free segments weren't coalesced", seg);
+            nfree++;
+            free += seg->size;
+            counts[GET_LIST(seg->size)]++;
+            bytes[GET_LIST(seg->size)] += seg->size;
+        }
+        else if (seg->type == SEGMENT_PENDING)
+        {
+            /* Counted as free, but not coalesced with its neighbors until it leaves Vmem::pending */
+            npending++;
+            free += seg->size;
+        }
+        else
+        {
+            VMEM_VERIFY(seg->type == SEGMENT_ALLOCATED, "segment has an unknown type", seg);
+            VMEM_VERIFY(hashtab_contains(vmp, seg), "allocated segment isn't in the hashtable", seg);
+            nalloc++;
+            in_use += seg->size;
+        }
+
+        prev = seg;
+        rotor = false;
     }
 
-    neighbor = TAILQ_PREV(seg, VmemSegQueue, segqueue);
+    if ((err = vmem_verify_span(vmp, span, prev, end)) != 0 || (err = vmem_verify_spans(vmp, spans, nspans <= maxspans ? nspans : 0)) != 0)
+        return err;
+
+    /* Every allocated segment was found in the hashtable, make sure it doesn't have any other entry */
+    for (i = 0, n = 0; i < vmp->hashsize; i++)
+    {
+        SLIST_FOREACH(seg, &vmp->hashtable[i], u.link)
+        {
+            VMEM_VERIFY(++n <= nalloc && seg->type == SEGMENT_ALLOCATED, "hashtable has extra entries", seg);
+        }
+    }
 
-    ASSERT(neighbor->type == SEGMENT_SPAN || neighbor->type == SEGMENT_ALLOCATED);
+    for (i = vmp->rehash_pos; vmp->oldhash != NULL && i < vmp->oldhashsize; i++)
+    {
+        SLIST_FOREACH(seg, &vmp->oldhash[i], u.link)
+        {
+            VMEM_VERIFY(++n <= nalloc && seg->type == SEGMENT_ALLOCATED, "hashtable has extra entries", seg);
+        }
+    }
 
-    seg->type = SEGMENT_FREE;
+    VMEM_VERIFY(n == nalloc && vmp->nalloc == nalloc, "hashtable entries don't match the allocated segments", NULL);
 
-    if (vmp->free != NULL && neighbor->type == SEGMENT_SPAN && neighbor->imported == true && neighbor->size == seg->size)
+    if (vmp->trees)
     {
-        uintptr_t span_addr = seg->base;
-        size_t span_size = seg->size;
+        n = 0;
+        prev = NULL;
 
-        TAILQ_REMOVE(&vmp->segqueue, seg, segqueue);
-        seg_free(seg);
-        TAILQ_REMOVE(&vmp->segqueue, neighbor, segqueue);
-        seg_free(neighbor);
+        if ((err = sizetree_verify(vmp, vmp->sizetree, &prev, &n)) != 0)
+            return err;
+
+        VMEM_VERIFY(n == nfree, "size tree doesn't match the free segments", NULL);
 
-        vmp->free(vmp->source, (void *)span_addr, span_size);
+        n = 0;
+        prev = NULL;
+
+        if ((err = addrtree_verify(vmp, vmp->addrtree, &prev, &n)) != 0)
+            return err;
+
+        VMEM_VERIFY(n == nfree, "address tree doesn't match the free segments", NULL);
     }
     else
     {
-        vmem_add_to_freelist(vmp, seg);
+        VMEM_VERIFY(vmp->sizetree == NULL && vmp->addrtree == NULL, "trees of an arena without trees aren't empty", NULL);
     }
 
-    vmp->stat.in_use -= size;
-    vmp->stat.free += size;
+    /* The freelist sizes were counted in the segment walk, each freelist must hold as many segments of the right sizes */
+    for (i = 0; i < FREELISTS_N; i++)
+    {
+        n = 0;
+
+        LIST_FOREACH(seg, &vmp->freelist[i], f.seglist)
+        {
+            VMEM_VERIFY(!vmp->trees && ++n <= counts[i], "freelist has extra segments", seg);
+            VMEM_VERIFY(seg->type == SEGMENT_FREE && (size_t)GET_LIST(seg->size) == i, "segment in the wrong freelist", seg);
+        }
+
+        VMEM_VERIFY(vmp->trees || n == counts[i], "freelist doesn't match the free segments", NULL);
+        VMEM_VERIFY(((vmp->freemap >> i) & 1) == (counts[i] != 0), "freemap doesn't match the freelists", NULL);
+        VMEM_VERIFY(vmp->stat.freelist_segs[i] == counts[i] && vmp->stat.freelist_bytes[i] == bytes[i], "wrong freelist statistics", NULL);
+    }
+
+    VMEM_VERIFY(vmp->stat.freesegs == nfree, "wrong number of free segments", NULL);
+
+    n = 0;
+
+    STAILQ_FOREACH(seg, &vmp->pending, u.queue)
+    {
+        VMEM_VERIFY(++n <= npending && seg->type == SEGMENT_PENDING, "pending list has extra segments", seg);
+    }
+
+    VMEM_VERIFY(n == npending, "pending list doesn't match the pending segments", NULL);
+
+    n = 0;
+
+    LIST_FOREACH(seg, &vmp->spanlist, f.spanlist)
+    {
+        VMEM_VERIFY(++n <= nidle && seg->type == SEGMENT_SPAN && seg->idle, "span list has extra spans", seg);
+    }
+
+    VMEM_VERIFY(n == nidle && vmp->nidle == nidle && vmp->idlebytes == idlebytes, "idle spans don't match the span list", NULL);
+
+    for (i = 0; i < VMEM_TAG_CLASSES; i++)
+    {
+        n = 0;
+
+        SLIST_FOREACH(seg, &vmp->freesegs[i], u.link)
+        {
+            /* Statically reserved tags are full-sized, they may be in either reserve */
+            VMEM_VERIFY(++n <= vmp->nfreesegs[i] && (seg_is_reserved(seg) || seg_class(seg) == (int)i), "tag reserve is wrong", NULL);
+        }
+
+        VMEM_VERIFY(n == vmp->nfreesegs[i], "tag reserve is shorter than its count", NULL);
+    }
+
+    VMEM_VERIFY(vmp->stat.in_use == in_use, "in_use doesn't match the allocated segments", NULL);
+    VMEM_VERIFY(vmp->stat.free == free, "free doesn't match the free segments", NULL);
+    VMEM_VERIFY(vmp->stat.total == total, "total doesn't match the spans", NULL);
+    VMEM_VERIFY(vmp->stat.import == import, "import doesn't match the imported spans", NULL);
+
+    return 0;
 }
 
-void vmem_free(Vmem *vmp, void *addr, size_t size)
+/* Pages needed by vmem_verify() to sort the spans of `vmp`. Must be called with the arena lock held. */
+static size_t vmem_verify_pages(Vmem *vmp)
+{
+    VmemSegment *seg;
+    size_t nspans = 0;
+
+    TAILQ_FOREACH(seg, &vmp->segqueue, segqueue)
+    {
+        if (seg->type == SEGMENT_SPAN)
+            nspans++;
+    }
+
+    return (nspans * sizeof(VmemSegment *) + VMEM_PAGE_SIZE - 1) / VMEM_PAGE_SIZE;
+}
+
+int vmem_verify(Vmem *vmp)
 {
-    vmem_xfree(vmp, addr, size);
+    VmemSegment **spans = NULL;
+    size_t pages = 0, need;
+    int err;
+
+    vmem_spin_lock(&vmp->lock);
+
+    /* The array to sort the spans is allocated with the lock dropped, again if spans were added in the meantime */
+    while ((need = vmem_verify_pages(vmp)) > pages)
+    {
+        vmem_spin_unlock(&vmp->lock);
+
+        if (spans != NULL)
+            vmem_free_pages(spans, pages);
+
+        spans = vmem_alloc_pages(need);
+        pages = spans != NULL ? need : 0;
+
+        vmem_spin_lock(&vmp->lock);
+
+        /* Without memory for the sort, the spans aren't checked for overlaps */
+        if (spans == NULL)
+            break;
+    }
+
+    err = vmem_verify_locked(vmp, spans, pages * VMEM_PAGE_SIZE / sizeof(VmemSegment *));
+    vmem_spin_unlock(&vmp->lock);
+
+    if (spans != NULL)
+        vmem_free_pages(spans, pages);
+
+    return err;
 }
 
 void vmem_dump(Vmem *vmp)
@@ -565,6 +2830,8 @@ void vmem_dump(Vmem *vmp)
     VmemSegment *span;
     size_t i;
 
+    vmem_spin_lock(&vmp->lock);
+
     vmem_printf("-- VMem arena \"%s\" segments -- \n", vmp->name);
 
     TAILQ_FOREACH(span, &vmp->segqueue, segqueue)
@@ -578,22 +2845,119 @@ void vmem_dump(Vmem *vmp)
 
     vmem_printf("Hashtable:\n ");
 
-    for (i = 0; i < ARR_SIZE(vmp->hashtable); i++)
-        LIST_FOREACH(span, &vmp->hashtable[i], seglist)
+    for (i = 0; i < vmp->hashsize; i++)
+        SLIST_FOREACH(span, &vmp->hashtable[i], u.link)
         {
             vmem_printf("%lx: [address: %p, size %p]\n", murmur64(span->base), (void *)span->base, (void *)span->size);
         }
+
+    for (i = vmp->rehash_pos; vmp->oldhash != NULL && i < vmp->oldhashsize; i++)
+        SLIST_FOREACH(span, &vmp->oldhash[i], u.link)
+        {
+            vmem_printf("%lx: [address: %p, size %p] (old)\n", murmur64(span->base), (void *)span->base, (void *)span->size);
+        }
     vmem_printf("Stat:\n");
     vmem_printf("- in_use: %ld\n", vmp->stat.in_use);
     vmem_printf("- free: %ld\n", vmp->stat.free);
     vmem_printf("- total: %ld\n", vmp->stat.total);
+    vmem_printf("- alloc: %ld\n", vmp->stat.alloc);
+    vmem_printf("- frees: %ld\n", vmp->stat.frees);
+    vmem_printf("- free segments: %ld\n", vmp->stat.freesegs);
+
+    vmem_spin_unlock(&vmp->lock);
+}
+
+void vmem_stat(Vmem *vmp, VmemStat *stat)
+{
+    VmemSegment *seg;
+    size_t outside;
+
+    vmem_spin_lock(&vmp->lock);
+    *stat = vmp->stat;
+    stat->largest = 0;
+
+    /* The root of the address tree knows the biggest free segment. Without trees, it's in the last non-empty freelist */
+    if (vmp->trees)
+    {
+        stat->largest = vmp->addrtree != NULL ? vmp->addrtree->u.amax : 0;
+    }
+    else if (vmp->freemap != 0)
+    {
+        LIST_FOREACH(seg, &vmp->freelist[GET_LIST(vmp->freemap)], f.seglist)
+        {
+            stat->largest = MAX(stat->largest, seg->size);
+        }
+    }
+
+    vmem_spin_unlock(&vmp->lock);
+
+    /* Scaled without overflowing, even for arenas covering most of the address space */
+    outside = stat->free - stat->largest;
+
+    if (stat->free == 0)
+        stat->extfrag = 0;
+    else if (stat->free > (size_t)-1 / 10000)
+        stat->extfrag = outside / (stat->free / 10000);
+    else
+        stat->extfrag = outside * 10000 / stat->free;
+}
+
+void vmem_counters(Vmem *vmp, VmemCounters *counters)
+{
+    vmem_spin_lock(&vmp->lock);
+    *counters = vmp->counters;
+    vmem_spin_unlock(&vmp->lock);
+}
+
+void vmem_set_timing(Vmem *vmp, bool enable)
+{
+    if (enable)
+    {
+        memset(&vmp->hist_alloc, 0, sizeof(vmp->hist_alloc));
+        memset(&vmp->hist_free, 0, sizeof(vmp->hist_free));
+    }
+
+    vmp->timed = enable;
+}
+
+void vmem_histograms(Vmem *vmp, VmemHistogram *alloc, VmemHistogram *free)
+{
+    if (alloc != NULL)
+        *alloc = vmp->hist_alloc;
+
+    if (free != NULL)
+        *free = vmp->hist_free;
+}
+
+unsigned long vmem_hist_min(size_t i)
+{
+    size_t log = (i >> VMEM_HIST_SUB_BITS) + VMEM_HIST_SUB_BITS - 1;
+
+    if (i < (1UL << VMEM_HIST_SUB_BITS))
+        return i;
+
+    return (1UL << log) + ((i & ((1UL << VMEM_HIST_SUB_BITS) - 1)) << (log - VMEM_HIST_SUB_BITS));
+}
+
+void vmem_tag_stat(VmemTagStat *stat)
+{
+    vmem_spin_lock(&seg_lock);
+    *stat = seg_stat;
+    vmem_spin_unlock(&seg_lock);
 }
 
 void vmem_bootstrap(void)
 {
     size_t i;
+
+    vmem_spin_lock(&seg_lock);
+
     for (i = 0; i < ARR_SIZE(static_segs); i++)
     {
-        seg_free(&static_segs[i]);
+        SLIST_INSERT_HEAD(&reserve_segs, &static_segs[i], u.link);
     }
+
+    seg_stat.reserve = ARR_SIZE(static_segs);
+
+    vmem_spin_unlock(&seg_lock);
 }
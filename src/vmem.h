@@ -18,7 +18,9 @@ small, precious resources (cited from paper) */
 
 /* Directs vmem to provide a
 good approximation to best−fit in guaranteed
-constant time. This is the default allocation policy. (cited from paper) */
+constant time. This is the default allocation policy. (cited from paper)
+Here the time is constant as long as the arena has no trees: once built for a VM_BESTFIT or constrained request,
+freelist heads are looked up in the size tree, in logarithmic time. */
 #define VM_INSTANTFIT (1 << 1)
 
 /* Directs vmem to use the next free
@@ -35,6 +37,7 @@ to cycle through all the IDs before reusing them. (cited from paper) */
 #define VM_BOOTSTRAP (1 << 5)
 
 #define VMEM_ERR_NO_MEM 1
+#define VMEM_ERR_CORRUPT 2
 
 struct vmem;
 
@@ -52,42 +55,219 @@ typedef void VmemFree(struct vmem *vmem, void *addr, size_t size);
 
 /* sizeof(void *) * CHAR_BIT (8) freelists provides us with a freelist for every power-of-2 length that can fit within the host's virtual address space (64 bit) */
 #define FREELISTS_N sizeof(void *) * CHAR_BIT
+
+/* The allocated segment hashtable starts with HASHTABLES_N buckets (stored in the arena itself)
+   and grows or shrinks with the number of allocated segments. Only allocations resize it */
 #define HASHTABLES_N 16
 
-typedef struct vmem_segment
+/* Quantum caches: "vmem_alloc() and vmem_free() are front-ended by one object cache for every
+   multiple of the quantum up to qcache_max" (cited from paper). Small allocations are served
+   from these caches in constant time instead of going through the segment lists. */
+#define VMEM_QCACHES_N 16
+
+/* Each quantum cache has a CPU layer: every CPU (every thread in userspace) owns a loaded and a previous
+   magazine of cached objects, so most allocations and frees never touch the arena.
+   VMEM_NCPU is the number of per-CPU slots, it can be overridden to match the host. */
+#ifndef VMEM_NCPU
+#    define VMEM_NCPU 64
+#endif
+
+/* A magazine (link + rounds) fits in 128 bytes on 64 bit hosts */
+#define VMEM_MAGAZINE_ROUNDS 14
+#define VMEM_CACHE_LINE 64
+
+/* Simple test-and-set spinlock */
+typedef volatile int VmemLock;
+
+enum
 {
-    enum
-    {
-        SEGMENT_ALLOCATED,
-        SEGMENT_FREE,
-        SEGMENT_SPAN
-    } type;
+    SEGMENT_ALLOCATED,
+    SEGMENT_FREE,
+    SEGMENT_SPAN,
+    SEGMENT_ROTOR,  /* Next-fit marker, see Vmem::rotor */
+    SEGMENT_PENDING /* Freed, but waiting for a full-size tag to be put in the freelists, see Vmem::pending */
+};
 
-    bool imported; /* Non-zero if imported */
+/* Boundary tags come in two sizes. Allocated segments, usually the vast majority, only use the fields up to
+   `f` (VMEM_TAG_SMALL, 48 bytes on 64 bit hosts); free and span segments need the whole structure (VMEM_TAG_FULL, 80 bytes).
+   Compared to the single 56 byte tag they replace, this only saves memory when allocated segments outnumber the others
+   by more than three to one, and by 14% at most. */
+#define VMEM_TAG_FULL 0
+#define VMEM_TAG_SMALL 1
+#define VMEM_TAG_CLASSES 2
+
+typedef struct vmem_segment
+{
+    unsigned char type;     /* SEGMENT_* */
+    unsigned char imported; /* Non-zero if imported */
+    unsigned char idle;     /* If an imported span, non-zero if it is entirely free and kept in Vmem::spanlist */
 
     uintptr_t base; /* base address of the segment */
     uintptr_t size; /* size of the segment */
 
     /* clang-format off */
   TAILQ_ENTRY(vmem_segment) segqueue; /* Points to Vmem::segqueue */
-  LIST_ENTRY(vmem_segment) seglist; /* If free, points to Vmem::freelist, if allocated, points to Vmem::hashtable, else Vmem::spanlist */
     /* clang-format on */
 
+    union
+    {
+        SLIST_ENTRY(vmem_segment) link;   /* If allocated, points to Vmem::hashtable; if unused, points to a list of free tags */
+        STAILQ_ENTRY(vmem_segment) queue; /* If pending, points to Vmem::pending */
+        uintptr_t amax;                   /* If free, size of the biggest segment in this Vmem::addrtree subtree */
+        unsigned long idlegen;            /* If an idle span, value of Vmem::reapgen when it became idle */
+    } u;
+
+    /* The fields below don't exist in VMEM_TAG_SMALL tags */
+    union
+    {
+        /* clang-format off */
+      LIST_ENTRY(vmem_segment) seglist; /* If free in an arena without trees, points to Vmem::freelist */
+        /* clang-format on */
+
+        struct
+        {
+            struct vmem_segment *sleft, *sright; /* Children in Vmem::sizetree */
+            struct vmem_segment *aleft, *aright; /* Children in Vmem::addrtree */
+        } tree;                                  /* If free in an arena with trees */
+
+        /* clang-format off */
+      LIST_ENTRY(vmem_segment) spanlist; /* If an idle span, points to Vmem::spanlist */
+        /* clang-format on */
+    } f;
 } VmemSegment;
 
 typedef LIST_HEAD(VmemSegList, vmem_segment) VmemSegList;
+typedef SLIST_HEAD(VmemSegSList, vmem_segment) VmemSegSList;
+typedef STAILQ_HEAD(VmemSegSTailq, vmem_segment) VmemSegSTailq;
 typedef TAILQ_HEAD(VmemSegQueue, vmem_segment) VmemSegQueue;
 
+/* A magazine is an M-element array of objects (rounds) that are allocated in the arena but not in use */
+typedef struct vmem_magazine
+{
+    /* clang-format off */
+  LIST_ENTRY(vmem_magazine) link; /* Points to the depot or the free magazine list */
+    /* clang-format on */
+    void *rounds[VMEM_MAGAZINE_ROUNDS];
+} VmemMagazine;
+
+typedef LIST_HEAD(VmemMagList, vmem_magazine) VmemMagList;
+
+/* The depot keeps the full and empty magazines that aren't loaded in any CPU.
+   To know how many of them are actually needed, it tracks the minimum number of magazines
+   in each list since the last vmem_reap() (the working set), anything below that minimum hasn't been used
+   during the whole interval and can be given back to the arena. */
+typedef struct
+{
+    VmemLock lock;
+    VmemMagList full;  /* Full magazines */
+    VmemMagList empty; /* Empty magazines */
+    size_t nfull;      /* Number of full magazines */
+    size_t nempty;     /* Number of empty magazines */
+    size_t fullmin;    /* Minimum of `nfull` since the last reap */
+    size_t emptymin;   /* Minimum of `nempty` since the last reap */
+} VmemDepot;
+
+/* CPU layer of a quantum cache, aligned on a cache line to avoid false sharing between CPUs */
+typedef struct
+{
+    VmemMagazine *loaded;   /* Currently loaded magazine */
+    VmemMagazine *previous; /* Previously loaded magazine */
+    VmemLock lock;          /* Protects this CPU's magazines */
+    int rounds;             /* Number of rounds in the loaded magazine */
+    int prounds;            /* Number of rounds in the previous magazine */
+} __attribute__((aligned(VMEM_CACHE_LINE))) VmemCpuCache;
+
+/* A quantum cache, holds objects of `size` bytes */
+typedef struct
+{
+    size_t size;                  /* Size of the cached objects (a multiple of the quantum) */
+    VmemDepot depot;              /* Depot layer */
+    VmemCpuCache *cpu;            /* CPU layer, VMEM_NCPU slots */
+} VmemQCache;
+
 /* Statistics about a Vmem arena, NOTE: this isn't described in the original paper and was added by me. Inspired by Illumos and Solaris'vmem_kstat_t */
 typedef struct
 {
     size_t in_use; /* Memory in use */
     size_t import; /* Imported memory */
     size_t total;  /* Total memory in the area */
-    size_t alloc;  /* Number of allocations */
-    size_t free;   /* Number of frees */
+    size_t free;   /* Free memory */
+    size_t alloc;  /* Number of segments allocated (objects of the quantum caches are counted when the caches get them) */
+    size_t frees;  /* Number of segments freed */
+
+    /* Fragmentation of the free memory */
+    size_t freesegs;                    /* Number of free segments */
+    size_t largest;                     /* Size of the largest free segment, only set by vmem_stat() */
+    size_t extfrag;                     /* Share of the free memory outside of the largest free segment, in 1/10000; only set by vmem_stat() */
+    size_t freelist_segs[FREELISTS_N];  /* Number of free segments in each freelist */
+    size_t freelist_bytes[FREELISTS_N]; /* Total size of the free segments in each freelist */
 } VmemStat;
 
+/* Statistics about the boundary tag pool, which is shared by every arena */
+typedef struct
+{
+    size_t bytes;   /* Memory used by the boundary tag slabs */
+    size_t inuse;   /* Boundary tags handed out to arenas (including their reserves) */
+    size_t peak;    /* Highest value of `inuse` so far */
+    size_t reserve; /* Statically allocated tags left for VM_BOOTSTRAP and for when no page can be allocated */
+} VmemTagStat;
+
+/* Hot-path event counters of an arena, to tell why allocations are slow. See vmem_counters() */
+typedef struct
+{
+    size_t buckets;        /* Freelists looked at by VM_INSTANTFIT allocations */
+    size_t fit_rejects;    /* Free segments big enough for an allocation, but that didn't satisfy its constraints */
+    size_t instant_slow;   /* VM_INSTANTFIT allocations that no freelist head could satisfy */
+    size_t misses;         /* Searches that found no free segment and fell through to an import */
+    size_t imports;        /* Spans imported from the source */
+    size_t releases;       /* Imported spans given back to the source */
+    size_t coalesce_left;  /* Segments freed next to a free segment on their left */
+    size_t coalesce_right; /* Segments freed next to a free segment on their right */
+    size_t hash_walked;    /* Hash chain entries walked to find the segments being freed */
+    size_t populates;      /* Tags taken from the global pool to refill the arena's reserves */
+} VmemCounters;
+
+/* Latency histograms are log-bucketed like HDR histograms: every power of two range is split into 2^VMEM_HIST_SUB_BITS
+   linear sub-buckets, so a bucket is at most 25% wider than its lower bound, whatever the magnitude */
+#define VMEM_HIST_SUB_BITS 2
+#define VMEM_HIST_BUCKETS ((sizeof(unsigned long) * CHAR_BIT - VMEM_HIST_SUB_BITS + 1) << VMEM_HIST_SUB_BITS)
+
+/* Latencies of an operation, in ticks of vmem_clock() (TSC cycles on x86, nanoseconds elsewhere in userspace) */
+typedef struct
+{
+    size_t count;                      /* Number of operations recorded */
+    unsigned long sum;                 /* Total latency */
+    unsigned long max;                 /* Highest latency */
+    size_t buckets[VMEM_HIST_BUCKETS]; /* buckets[i] counts the latencies in [vmem_hist_min(i), vmem_hist_min(i + 1)) */
+} VmemHistogram;
+
+/* Events recorded by an arena being traced, see vmem_trace_start() */
+enum
+{
+    VMEM_TRACE_ARENA,   /* First event of a trace: `addr` is the quantum, `size` is qcache_max and `vmflag` the arena's flags */
+    VMEM_TRACE_SOURCE,  /* The arena imports spans of `addr` to `size` bytes (see vmem_set_import()), `vmflag` is log2 of the source's quantum */
+    VMEM_TRACE_ADD,     /* Span [addr, addr + size) added with vmem_add() */
+    VMEM_TRACE_IMPORT,  /* Span [addr, addr + size) imported from the source */
+    VMEM_TRACE_RELEASE, /* Imported span [addr, addr + size) given back to the source */
+    VMEM_TRACE_ALLOC,   /* vmem_alloc() of `size` bytes, which returned `addr` */
+    VMEM_TRACE_FREE,    /* vmem_free() of [addr, addr + size) */
+    VMEM_TRACE_XALLOC,  /* vmem_xalloc() of `size` bytes, which returned `addr`. Constraints are given by the events right before it */
+    VMEM_TRACE_XFREE,   /* vmem_xfree() of [addr, addr + size) */
+    VMEM_TRACE_ALIGN,   /* `addr` is the alignment and `size` the phase of the next VMEM_TRACE_XALLOC */
+    VMEM_TRACE_NOCROSS, /* `size` is the nocross boundary of the next VMEM_TRACE_XALLOC */
+    VMEM_TRACE_RANGE    /* [addr, size) is the [minaddr, maxaddr) range of the next VMEM_TRACE_XALLOC */
+};
+
+/* A trace event (24 bytes on 64 bit hosts). Traces are raw arrays of events, so they can only be replayed
+   on hosts with the same word size and byte order. */
+typedef struct
+{
+    uint16_t type;   /* VMEM_TRACE_* */
+    uint16_t vmflag; /* Flags of the allocation */
+    uintptr_t addr;
+    uintptr_t size;
+} VmemTraceEvent;
+
 /* Description of an arena, a collection of resources. An arena is simply a set of integers. */
 typedef struct vmem
 {
@@ -101,15 +281,59 @@ typedef struct vmem
     size_t qcache_max;   /* Maximum size to cache */
     int vmflag;          /* VM_SLEEP or VM_NOSLEEP */
 
+    VmemLock lock; /* Protects the segment lists, the hashtable and the statistics below */
+
+    size_t import_min;  /* Minimum size of an imported span, see vmem_set_import() */
+    size_t import_max;  /* Maximum size the imports grow to */
+    size_t import_next; /* Size of the next import, doubled by each import and halved by each span release */
+
     VmemSegQueue segqueue;
-    VmemSegList freelist[FREELISTS_N];   /* Power of two freelists. Freelists[n] contains all free segments whose sizes are in the range [2^n, 2^n+1]  */
-    VmemSegList hashtable[HASHTABLES_N]; /* Allocated segments */
-    VmemSegList spanlist;                /* Span marker segments */
+    VmemSegList freelist[FREELISTS_N];   /* Power of two freelists. Freelist[n] holds the free segments whose sizes are in the range [2^n, 2^(n+1)),
+                                            most recently freed first. Empty once the arena has trees: the size tree holds them instead */
+    uintptr_t freemap;                   /* Bit n is set if there are free segments of freelist[n]'s sizes */
+    bool trees;                          /* The free segments are indexed by the trees below, built by the first request needing them */
+    VmemSegment *sizetree;               /* Free segments ordered by (size, address), used by VM_BESTFIT */
+    VmemSegment *addrtree;               /* Free segments ordered by address, used by constrained allocations */
+    VmemSegSList *hashtable;             /* Allocated segments, `hashsize` buckets */
+    VmemSegSList *oldhash;               /* While resizing, previous hashtable whose buckets are migrated a few at a time.
+                                            Freed by the next allocation once migrated */
+    size_t hashsize;                     /* Number of buckets in `hashtable`, always a power of two */
+    size_t oldhashsize;                  /* Number of buckets in `oldhash` */
+    size_t rehash_pos;                   /* Buckets of `oldhash` below this index have already been migrated */
+    size_t nalloc;                       /* Number of allocated segments */
+    VmemSegSList hash0[HASHTABLES_N];    /* Initial hashtable */
+    VmemSegList spanlist;                /* Idle imported spans, most recently idle first */
+    size_t nidle;                        /* Number of spans in `spanlist` */
+    size_t idlebytes;                    /* Total size of the spans in `spanlist` */
+    size_t idle_max;                     /* Maximum number of idle spans kept, see vmem_set_retain() */
+    size_t idle_max_bytes;               /* Maximum total size of the idle spans kept */
+    unsigned long reapgen;               /* Number of calls to vmem_reap() */
+    VmemSegSList freesegs[VMEM_TAG_CLASSES]; /* Reserve of boundary tags of each size, so that splitting a segment never fails */
+    size_t nfreesegs[VMEM_TAG_CLASSES];      /* Number of tags in each reserve */
+    VmemSegSTailq pending;                   /* Segments freed while no full-size tag was in the reserve, oldest first.
+                                                A free never allocates tags, so they're put in the freelists by the next allocation */
+    VmemSegment rotor;                   /* VM_NEXTFIT marker in `segqueue`, placed right after the last next-fit allocation */
+
+    VmemQCache *qcache; /* qcache[n] caches objects of (n + 1) * quantum bytes, up to qcache_max. Allocated by vmem_init()
+                           along with their CPU layers, NULL if the arena has no quantum caches */
+
+    VmemCounters counters; /* Hot-path event counters, only updated with `lock` held */
+
+    volatile bool timed;      /* Record the latencies of the arena's operations, see vmem_set_timing() */
+    VmemHistogram hist_alloc; /* Latencies of the allocations that reached the arena */
+    VmemHistogram hist_free;  /* Latencies of the frees that reached the arena */
+
+    VmemTraceEvent *volatile trace; /* Trace buffer, NULL if the arena isn't traced */
+    size_t tracesize;               /* Number of events in `trace` */
+    size_t tracehead;               /* Events at the start of `trace` describing the arena, never overwritten */
+    size_t tracepos;                /* Number of events recorded after the head, the others are a ring */
+    volatile size_t tracers;        /* Threads writing to `trace`, some without the arena lock: vmem_trace_stop() waits for them */
 
     VmemStat stat;
 } Vmem;
 
-/* Initializes a vmem arena (no malloc) */
+/* Initializes a vmem arena (no malloc). If `qcache_max` isn't 0, the quantum caches are allocated from pages,
+   sized for the caches actually used: returns -VMEM_ERR_NO_MEM if they can't be. */
 int vmem_init(Vmem *vmem, char *name, void *base, size_t size, size_t quantum, VmemAlloc *afunc, VmemFree *ffunc, Vmem *source, size_t qcache_max, int vmflag);
 
 /* Destroys arena `vmp` */
@@ -132,6 +356,8 @@ aligned boundary. vmflag is as above. One performance caveat: if either minaddr
 non−NULL, vmem may not be able to satisfy the allocation in constant time. If allocations within a
 given [minaddr, maxaddr) range are common it is more efficient to declare that range to be its own
 arena and use unconstrained allocations on the new arena (cited from paper).
+An arena importing from a source can't choose where its spans land: it imports a span big enough for the
+alignment, and if that span still doesn't fit the constraints, gives it back and fails.
 */
 void *vmem_xalloc(Vmem *vmp, size_t size, size_t align, size_t phase,
                   size_t nocross, void *minaddr, void *maxaddr, int vmflag);
@@ -146,6 +372,57 @@ void vmem_xfree(Vmem *vmp, void *addr, size_t size);
    vmem_add() will fail only if vmflag is VM_NOSLEEP and no resources are currently available. (cited from paper) */
 void *vmem_add(Vmem *vmp, void *addr, size_t size, int vmflag);
 
+/* Makes `vmp` import spans of at least `min` bytes from its source. The import size doubles with each import,
+   up to `max` bytes, and halves (down to `min`) whenever a span is given back. Imports are rounded to the source's quantum.
+   By default (min = 0), spans are imported with the size of the allocation that needed them. */
+void vmem_set_import(Vmem *vmp, size_t min, size_t max);
+
+/* Makes `vmp` keep up to `nspans` imported spans, totalling at most `bytes` bytes, once all their segments are freed
+   instead of giving them back to the source right away. Idle spans are given back by vmem_reap() once they stayed unused
+   for a whole reap interval. By default (0, 0), spans are given back as soon as they're free. */
+void vmem_set_retain(Vmem *vmp, size_t nspans, size_t bytes);
+
+/* Gives the cached resources that weren't needed since the last call back to the arena `vmp`.
+   It should be called periodically (Solaris does it every 15 seconds) */
+void vmem_reap(Vmem *vmp);
+
+/* Fills `stat` with a consistent snapshot of the statistics of `vmp`, including its fragmentation. It runs in constant time,
+   so it can be polled to notice fragmentation before allocations start failing. */
+void vmem_stat(Vmem *vmp, VmemStat *stat);
+
+/* Fills `counters` with a consistent snapshot of the hot-path event counters of `vmp` */
+void vmem_counters(Vmem *vmp, VmemCounters *counters);
+
+/* Starts (and clears) or stops recording the latency of every allocation and free that reaches `vmp` (the ones served by the quantum
+   caches are fast enough already). Timing costs two clock reads and a few atomic increments per operation, and nothing when disabled. */
+void vmem_set_timing(Vmem *vmp, bool enable);
+
+/* Copies the latency histograms of `vmp`, either may be NULL. Operations recorded concurrently may be partially included. */
+void vmem_histograms(Vmem *vmp, VmemHistogram *alloc, VmemHistogram *free);
+
+/* Returns the lowest latency counted in bucket `i` of a histogram */
+unsigned long vmem_hist_min(size_t i);
+
+/* Fills `stat` with the statistics of the boundary tag pool */
+void vmem_tag_stat(VmemTagStat *stat);
+
+/* Starts recording the operations on `vmp` in the `n` events of `buf`. The trace begins with a description of the arena,
+   its source and its spans, followed by a ring of the most recent events: a buffer that's too small keeps only the end of the trace.
+   Returns -VMEM_ERR_NO_MEM if `buf` can't even hold the description of the arena. */
+int vmem_trace_start(Vmem *vmp, VmemTraceEvent *buf, size_t n);
+
+/* Stops tracing `vmp`, and orders its trace buffer from the oldest event to the newest.
+   Returns the number of events in the buffer. Events recorded concurrently by other threads may be lost, but the buffer is
+   never written once this returns. */
+size_t vmem_trace_stop(Vmem *vmp);
+
+/* Checks the consistency of arena `vmp`: segments are contiguous and ordered within their spans, spans don't overlap,
+   no two free segments are adjacent, free segments are in the right freelist (or in both trees, once the arena has them),
+   allocated segments are in the hashtable, and the statistics match the segments. Returns 0 if the arena is consistent, else
+   prints the first problem found and returns -VMEM_ERR_CORRUPT. For tests and benchmarks: it takes O(n + s log s) time for n
+   segments and s spans, the spans being sorted in an array allocated before the arena lock is taken. */
+int vmem_verify(Vmem *vmp);
+
 /* Dumps the arena `vmp` using the `kprintf` function */
 void vmem_dump(Vmem *vmp);
 
@@ -0,0 +1,359 @@
+/* Synthetic workloads modelled on real VMem users, run by `meson test --benchmark`:
+ *  - pid:    process IDs, a small quantum=1 space allocated with VM_NEXTFIT
+ *  - kva:    kernel virtual addresses, page quantum, mixed sizes, partly long-lived, front-ended by quantum caches
+ *  - iova:   I/O virtual addresses, size-aligned and range constrained mappings completed in order
+ *  - extent: filesystem extents, large power-law sizes allocated with VM_BESTFIT
+ * Usage: vmem-workload [-t] <workload> [steps [trace]]
+ * Every `steps / WL_REPORTS` steps, the throughput, fragmentation and boundary tag count are printed.
+ * If a trace file is given, the run is recorded into it for vmem-replay.
+ * With -t, the arena's operations are timed (which slows them down) and their latency percentiles are printed at the end,
+ * in vmem_clock() ticks. */
+
+#define _POSIX_C_SOURCE 199309L /* clock_gettime() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vmem.h>
+
+#define WL_STEPS 1000000
+#define WL_REPORTS 10
+
+/* Maximum number of live objects of a workload */
+#define WL_LIVE_MAX 65536
+
+typedef struct
+{
+    void *addr;
+    size_t size;
+    bool constrained; /* Allocated with vmem_xalloc() */
+} WlObject;
+
+typedef struct
+{
+    const char *name;
+    void (*init)(void);
+    void (*step)(void);
+} Workload;
+
+static Vmem wl_arena;
+static unsigned long wl_seed = 0x2545f4914f6cdd1dUL;
+static unsigned long wl_ops;
+
+/* Live objects, freed in a random order */
+static WlObject wl_live[WL_LIVE_MAX];
+static size_t wl_nlive;
+
+/* Long-lived objects, only freed at the end */
+static WlObject wl_long[WL_LIVE_MAX];
+static size_t wl_nlong;
+
+/* Objects freed in allocation order, `wl_head` is the oldest */
+static WlObject wl_fifo[WL_LIVE_MAX];
+static size_t wl_head, wl_nfifo;
+
+static unsigned long wl_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+/* xorshift, so that the sequence doesn't depend on the C library */
+static unsigned long wl_rand(void)
+{
+    wl_seed ^= wl_seed << 13;
+    wl_seed ^= wl_seed >> 7;
+    wl_seed ^= wl_seed << 17;
+    return wl_seed;
+}
+
+/* Returns 2^k with probability 2^-(k+1), k < `maxlog`: a power law */
+static size_t wl_powerlaw(int maxlog)
+{
+    return (size_t)1 << __builtin_ctzl(wl_rand() | (1UL << (maxlog - 1)));
+}
+
+static void wl_check(void *addr)
+{
+    if (addr == NULL)
+    {
+        fprintf(stderr, "workload: allocation failed\n");
+        exit(1);
+    }
+}
+
+static WlObject wl_alloc(size_t size, int vmflag)
+{
+    WlObject obj;
+
+    obj.addr = vmem_alloc(&wl_arena, size, vmflag | VM_NOSLEEP);
+    obj.size = size;
+    obj.constrained = false;
+    wl_check(obj.addr);
+    wl_ops++;
+
+    return obj;
+}
+
+static void wl_free(WlObject *obj)
+{
+    if (obj->constrained)
+        vmem_xfree(&wl_arena, obj->addr, obj->size);
+    else
+        vmem_free(&wl_arena, obj->addr, obj->size);
+
+    wl_ops++;
+}
+
+/* Frees a random live object */
+static void wl_free_random(void)
+{
+    size_t i = wl_rand() % wl_nlive;
+
+    wl_free(&wl_live[i]);
+    wl_live[i] = wl_live[--wl_nlive];
+}
+
+static void pid_init(void)
+{
+    /* Like PID_MAX_DEFAULT, PID 0 isn't allocatable */
+    vmem_init(&wl_arena, "pid", (void *)1, 32767, 1, NULL, NULL, NULL, 0, 0);
+}
+
+/* Processes are forked and exit, the number of processes wanders between a few and a few thousands */
+static void pid_step(void)
+{
+    if (wl_nlive == 0 || (wl_nlive < 4096 && wl_rand() % 2 == 0))
+        wl_live[wl_nlive++] = wl_alloc(1, VM_NEXTFIT);
+    else
+        wl_free_random();
+}
+
+static void kva_init(void)
+{
+    vmem_init(&wl_arena, "kva", (void *)0x40000000, 0x40000000, 0x1000, NULL, NULL, NULL, 0x1000 * 8, 0);
+}
+
+/* Mostly small allocations (1-16 pages, power law) with the occasional big one; a few live until the end */
+static void kva_step(void)
+{
+    size_t size = wl_rand() % 64 == 0 ? (1 + wl_rand() % 256) : wl_powerlaw(5);
+
+    if (wl_nlive > 0 && (wl_nlive >= 8192 || wl_rand() % 2 == 0))
+    {
+        wl_free_random();
+        return;
+    }
+
+    if (wl_nlong < WL_LIVE_MAX && wl_rand() % 256 == 0)
+        wl_long[wl_nlong++] = wl_alloc(size * 0x1000, VM_INSTANTFIT);
+    else
+        wl_live[wl_nlive++] = wl_alloc(size * 0x1000, VM_INSTANTFIT);
+}
+
+static void iova_init(void)
+{
+    vmem_init(&wl_arena, "iova", (void *)0x1000, 0x7ffff000, 0x1000, NULL, NULL, NULL, 0, 0);
+}
+
+/* Mappings are aligned on their size, half of them are below a 32 bit DMA mask of 1GB, and they are unmapped in order
+ * once the queue (whose depth changes over time) is full */
+static void iova_step(void)
+{
+    size_t depth = 256 << (wl_ops / 100000 % 5);
+    WlObject *obj;
+    void *maxaddr;
+
+    if (wl_nfifo >= depth)
+    {
+        wl_free(&wl_fifo[wl_head]);
+        wl_head = (wl_head + 1) % WL_LIVE_MAX;
+        wl_nfifo--;
+        return;
+    }
+
+    obj = &wl_fifo[(wl_head + wl_nfifo++) % WL_LIVE_MAX];
+    obj->size = wl_powerlaw(9) * 0x1000;
+    obj->constrained = true;
+    maxaddr = wl_rand() % 2 ? (void *)0x40000000 : (void *)~(uintptr_t)0;
+    obj->addr = vmem_xalloc(&wl_arena, obj->size, obj->size, 0, 0, (void *)0, maxaddr, VM_INSTANTFIT | VM_NOSLEEP);
+    wl_check(obj->addr);
+    wl_ops++;
+}
+
+static void extent_init(void)
+{
+    /* 2^20 blocks, block 0 holds the superblock (and would look like a failed allocation) */
+    vmem_init(&wl_arena, "extent", (void *)1, 0x100000, 1, NULL, NULL, NULL, 0, 0);
+}
+
+/* Two files are created for each one deleted until the disk is about 70% full, then the disk stays at that level */
+static void extent_step(void)
+{
+    size_t size = wl_powerlaw(16) + wl_rand() % 16;
+
+    if (wl_nlive > 0 && (wl_nlive >= WL_LIVE_MAX || wl_arena.stat.in_use + size > wl_arena.size / 10 * 7 || wl_rand() % 3 == 0))
+        wl_free_random();
+    else
+        wl_live[wl_nlive++] = wl_alloc(size, VM_BESTFIT);
+}
+
+static const Workload workloads[] = {
+    {"pid", pid_init, pid_step},
+    {"kva", kva_init, kva_step},
+    {"iova", iova_init, iova_step},
+    {"extent", extent_init, extent_step},
+};
+
+static void wl_report(unsigned long step, unsigned long ops, unsigned long elapsed)
+{
+    VmemTagStat tags;
+    VmemStat stat;
+
+    vmem_stat(&wl_arena, &stat);
+    vmem_tag_stat(&tags);
+
+    printf("%10lu %12.0f %7lu %12lu %12lu %6.2f %12lu %8lu %8lu\n", step,
+           elapsed ? ops * 1e9 / elapsed : 0.0, (unsigned long)(wl_nlive + wl_nlong + wl_nfifo),
+           (unsigned long)stat.in_use, (unsigned long)stat.free, stat.extfrag / 100.0, (unsigned long)stat.largest,
+           (unsigned long)tags.inuse, (unsigned long)tags.peak);
+}
+
+/* Lower bound of the bucket holding the `permille`th latency */
+static unsigned long wl_percentile(const VmemHistogram *hist, size_t permille)
+{
+    size_t i, seen = 0, rank = hist->count * permille / 1000;
+
+    for (i = 0; i < VMEM_HIST_BUCKETS; i++)
+    {
+        seen += hist->buckets[i];
+
+        if (seen > rank)
+            return vmem_hist_min(i);
+    }
+
+    return hist->max;
+}
+
+static void wl_latency(const char *name, const VmemHistogram *hist)
+{
+    printf("%-6s %10lu %10lu %10lu %10lu %10lu %10lu\n", name, (unsigned long)hist->count,
+           hist->count ? hist->sum / hist->count : 0, wl_percentile(hist, 500), wl_percentile(hist, 990),
+           wl_percentile(hist, 999), hist->max);
+}
+
+static void wl_save_trace(const char *path, VmemTraceEvent *trace, size_t n)
+{
+    FILE *f = fopen(path, "wb");
+
+    if (f == NULL || fwrite(trace, sizeof(*trace), n, f) != n || fclose(f) != 0)
+    {
+        fprintf(stderr, "workload: can't write %s\n", path);
+        exit(1);
+    }
+
+    printf("%lu events traced to %s\n", (unsigned long)n, path);
+}
+
+int main(int argc, char **argv)
+{
+    const Workload *wl = NULL;
+    unsigned long steps = WL_STEPS, step, start, ops;
+    VmemTraceEvent *trace = NULL;
+    VmemHistogram alloc, frees;
+    size_t i, ntrace;
+    bool timing = false;
+
+    if (argc > 1 && strcmp(argv[1], "-t") == 0)
+    {
+        timing = true;
+        argc--;
+        argv++;
+    }
+
+    for (i = 0; argc > 1 && i < sizeof(workloads) / sizeof(*workloads); i++)
+    {
+        if (strcmp(argv[1], workloads[i].name) == 0)
+            wl = &workloads[i];
+    }
+
+    if (wl == NULL)
+    {
+        fprintf(stderr, "usage: %s [-t] pid|kva|iova|extent [steps [trace]]\n", argv[0]);
+        return 1;
+    }
+
+    if (argc > 2)
+        steps = strtoul(argv[2], NULL, 0);
+
+    if (steps < WL_REPORTS)
+        steps = WL_REPORTS;
+
+    vmem_bootstrap();
+    wl->init();
+
+    /* Every step is at most one operation, recorded with up to two constraints, then the live objects are freed */
+    if (argc > 3)
+    {
+        ntrace = (steps + WL_LIVE_MAX) * 3 + 16;
+        trace = malloc(ntrace * sizeof(*trace));
+
+        if (trace == NULL || vmem_trace_start(&wl_arena, trace, ntrace) != 0)
+        {
+            fprintf(stderr, "workload: can't trace\n");
+            return 1;
+        }
+    }
+
+    printf("workload: %s\n", wl->name);
+    printf("%10s %12s %7s %12s %12s %6s %12s %8s %8s\n", "step", "ops/s", "live", "in use", "free", "frag%",
+           "largest free", "tags", "peak");
+
+    vmem_set_timing(&wl_arena, timing);
+    start = wl_now();
+    ops = wl_ops;
+
+    for (step = 1; step <= steps; step++)
+    {
+        wl->step();
+
+        if (step % (steps / WL_REPORTS) == 0)
+        {
+            wl_report(step, wl_ops - ops, wl_now() - start);
+
+            if (vmem_verify(&wl_arena) != 0)
+                return 1;
+
+            start = wl_now();
+            ops = wl_ops;
+        }
+    }
+
+    while (wl_nlive > 0)
+        wl_free_random();
+
+    while (wl_nlong > 0)
+        wl_free(&wl_long[--wl_nlong]);
+
+    for (; wl_nfifo > 0; wl_nfifo--, wl_head = (wl_head + 1) % WL_LIVE_MAX)
+        wl_free(&wl_fifo[wl_head]);
+
+    if (timing)
+    {
+        vmem_histograms(&wl_arena, &alloc, &frees);
+        printf("%-6s %10s %10s %10s %10s %10s %10s\n", "ticks", "ops", "mean", "p50", "p99", "p999", "max");
+        wl_latency("alloc", &alloc);
+        wl_latency("free", &frees);
+    }
+
+    if (trace != NULL)
+        wl_save_trace(argv[3], trace, vmem_trace_stop(&wl_arena));
+
+    vmem_destroy(&wl_arena);
+    free(trace);
+
+    return 0;
+}